@@ -0,0 +1,229 @@
+#ifndef APPROXIMATE_H
+#define APPROXIMATE_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include "sparse_histogram.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/tick_count.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief How the values of a sample are drawn.
+ *
+ */
+enum SamplingMode
+{
+    SAMPLING_UNIFORM,   // Every value drawn from anywhere in the input
+    SAMPLING_STRATIFIED // The input split in equal blocks, each drawn from equally
+};
+
+/**
+ * @brief Blocks of the input sampled separately in SAMPLING_STRATIFIED mode.
+ * Inputs often drift along their length (time series, appended logs), and
+ * drawing the same number from every block keeps the sample spread over it.
+ *
+ */
+const size_t SAMPLING_STRATA = 256;
+
+/**
+ * @brief Size of the first sample taken by progressive_histogram; every
+ * refinement doubles it
+ *
+ */
+const int64_t SAMPLING_INITIAL_SIZE = 1 << 14;
+
+/**
+ * @brief Normal quantile of a two-sided 95% confidence interval
+ *
+ */
+const double CONFIDENCE_Z_95 = 1.96;
+
+/**
+ * @brief Histogram estimated from a sample of the values, scaled to the whole
+ * input, with a confidence interval for the count of every bin.
+ *
+ */
+struct ApproximateHistogram
+{
+    Histogram estimate;             // Counts of the sample scaled to the input
+    std::vector<double> lower;      // Lower end of the interval of each count
+    std::vector<double> upper;      // Upper end of the interval of each count
+    std::vector<int64_t> sampled;   // Values of the sample in each bin
+    int64_t sample_size = 0;        // Values sampled, 0 if the counts are exact
+    double error = 0.0;             // Widest half-interval, as a fraction of the input
+    double seconds = 0.0;           // Time spent sampling
+};
+
+/**
+ * @brief Draws values with replacement and adds them to the per-bin counts of
+ * a sample. The d-th draw picks its index from a hash of (seed, d), so the
+ * sample does not depend on how TBB splits the draws between tasks, and no
+ * random number generator has to be shared or copied.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param first index of the first draw
+ * @param draws number of draws
+ * @param mode how the values are drawn
+ * @param seed seed of the sample
+ * @param sampled per-bin counts of the sample, updated
+ */
+inline void sample_counts(const int *values, size_t n, const BinSpec &spec, int64_t first, int64_t draws,
+                          SamplingMode mode, uint64_t seed, std::vector<int64_t> &sampled)
+{
+    const size_t strata = mode == SAMPLING_STRATIFIED ? std::min(SAMPLING_STRATA, n) : 1;
+    oneapi::tbb::enumerable_thread_specific<std::vector<int64_t>> locals(sampled.size(), 0);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<int64_t>(first, first + draws),
+        [&](oneapi::tbb::blocked_range<int64_t> r)
+        {
+            TRACE_CHUNK("sample", r);
+            std::vector<int64_t> &local = locals.local();
+            for (int64_t d = r.begin(); d < r.end(); d++)
+            {
+                // Draws go round the strata, so each one gets the same share
+                const size_t stratum = size_t(d) % strata;
+                const size_t begin = stratum * n / strata;
+                const size_t size = (stratum + 1) * n / strata - begin;
+                const size_t i = begin + hash_key(seed ^ hash_key(uint64_t(d))) % size;
+                local[spec.bin_of(values[i])]++;
+            }
+        });
+    for (const std::vector<int64_t> &local : locals)
+    {
+        for (size_t j = 0; j < sampled.size(); j++)
+        {
+            sampled[j] += local[j];
+        }
+    }
+}
+
+/**
+ * @brief Scales the counts of a sample to the whole input and computes the
+ * confidence interval of every bin: the fraction of the input in a bin is
+ * binomial over the sample, and its Wilson score interval is used, which,
+ * unlike the normal approximation, stays within [0, 1] and is not empty for
+ * bins with no values sampled. For a stratified sample it is conservative.
+ *
+ * @param sampled per-bin counts of the sample
+ * @param sample_size values sampled
+ * @param n number of values of the input
+ * @param z normal quantile of the confidence wanted
+ * @return ApproximateHistogram with the estimate and its intervals
+ */
+inline ApproximateHistogram scale_sample(const std::vector<int64_t> &sampled, int64_t sample_size, size_t n, double z)
+{
+    ApproximateHistogram result;
+    result.sampled = sampled;
+    result.sample_size = sample_size;
+    result.estimate.counts.resize(sampled.size());
+    result.lower.resize(sampled.size());
+    result.upper.resize(sampled.size());
+
+    const double m = double(sample_size);
+    const double z2 = z * z;
+    for (size_t j = 0; j < sampled.size(); j++)
+    {
+        const double p = sampled[j] / m;
+        const double center = (p + z2 / (2 * m)) / (1 + z2 / m);
+        const double half = z / (1 + z2 / m) * std::sqrt(p * (1 - p) / m + z2 / (4 * m * m));
+        result.estimate.counts[j] = std::llround(p * n);
+        result.lower[j] = std::max(0.0, center - half) * n;
+        result.upper[j] = std::min(1.0, center + half) * n;
+        result.error = std::max(result.error, half);
+    }
+    result.estimate.cumulative = cumulative_sum(result.estimate.counts);
+    return result;
+}
+
+/**
+ * @brief Approximate engine: histograms a sample of sample_size values drawn
+ * in parallel, instead of every value, and scales the counts to the input.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param sample_size number of values to be drawn
+ * @param mode how the values are drawn
+ * @param seed seed of the sample
+ * @param z normal quantile of the confidence wanted
+ * @return ApproximateHistogram with the estimate and its intervals
+ */
+inline ApproximateHistogram approximate_histogram(const int *values, size_t n, const BinSpec &spec, int64_t sample_size,
+                                                  SamplingMode mode = SAMPLING_STRATIFIED, uint64_t seed = 0,
+                                                  double z = CONFIDENCE_Z_95)
+{
+    PROFILE_STAGE(sample_timer, "approximate", "sample");
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    std::vector<int64_t> sampled(spec.num_bins, 0);
+    if (n > 0 && sample_size > 0)
+    {
+        sample_counts(values, n, spec, 0, sample_size, mode, seed, sampled);
+    }
+    ApproximateHistogram result = scale_sample(sampled, std::max<int64_t>(1, sample_size), n, z);
+    result.seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+    return result;
+}
+
+/**
+ * @brief Progressive approximate engine: starts with a sample of
+ * SAMPLING_INITIAL_SIZE values and keeps doubling it, adding new draws to the
+ * ones already counted, until the widest confidence half-interval is at most
+ * target_error (as a fraction of the input) or the time budget is spent.
+ * When the next sample would not be smaller than the input itself, the exact
+ * histogram is computed instead.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param target_error widest half-interval wanted, as a fraction of the input
+ * @param time_budget seconds after which no more refinements are started
+ * @param mode how the values are drawn
+ * @param seed seed of the sample
+ * @param z normal quantile of the confidence wanted
+ * @return ApproximateHistogram with the last estimate and its intervals
+ */
+inline ApproximateHistogram progressive_histogram(const int *values, size_t n, const BinSpec &spec, double target_error,
+                                                  double time_budget, SamplingMode mode = SAMPLING_STRATIFIED,
+                                                  uint64_t seed = 0, double z = CONFIDENCE_Z_95)
+{
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    std::vector<int64_t> sampled(spec.num_bins, 0);
+    int64_t sample_size = 0;
+    int64_t next = std::min<int64_t>(SAMPLING_INITIAL_SIZE, n);
+    while (true)
+    {
+        if (next >= int64_t(n))
+        {
+            ApproximateHistogram exact;
+            exact.estimate = privatized_histogram(values, n, spec);
+            exact.sampled = exact.estimate.counts;
+            exact.lower.assign(exact.estimate.counts.begin(), exact.estimate.counts.end());
+            exact.upper = exact.lower;
+            exact.seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+            return exact;
+        }
+
+        PROFILE_STAGE(sample_timer, "approximate", "refine");
+        sample_counts(values, n, spec, sample_size, next - sample_size, mode, seed, sampled);
+        PROFILE_STOP(sample_timer);
+        sample_size = next;
+
+        ApproximateHistogram result = scale_sample(sampled, sample_size, n, z);
+        result.seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+        if (result.error <= target_error || result.seconds >= time_budget)
+        {
+            return result;
+        }
+        next = 2 * sample_size;
+    }
+}
+
+#endif
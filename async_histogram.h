@@ -0,0 +1,244 @@
+#ifndef ASYNC_HISTOGRAM_H
+#define ASYNC_HISTOGRAM_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/task_arena.h>
+#include <oneapi/tbb/task_group.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Values counted between two checks for cancellation, so a canceled
+ * histogram releases its threads within a fraction of a millisecond even if
+ * its chunks are large
+ *
+ */
+const size_t ASYNC_CANCEL_CHECK_VALUES = 1 << 14;
+
+/**
+ * @brief Handle of a histogram computed in the background by
+ * async_histogram. Copies share the same computation.
+ *
+ */
+class HistogramFuture
+{
+public:
+    using Callback = std::function<void(const HistogramFuture &)>;
+
+    /**
+     * @brief Whether the computation has finished, either complete or
+     * canceled, without blocking.
+     *
+     * @return true if it has finished
+     */
+    bool poll() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+
+    /**
+     * @brief Blocks until the computation has finished.
+     *
+     */
+    void wait() const
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [this]
+                             { return state->done; });
+    }
+
+    /**
+     * @brief Waits for the histogram.
+     *
+     * @return const Histogram& with the regular and cumulative histograms,
+     * empty if the computation was canceled
+     */
+    const Histogram &get() const
+    {
+        wait();
+        return state->result;
+    }
+
+    /**
+     * @brief Whether the computation was canceled before it completed.
+     *
+     * @return true if canceled; only final once poll returns true
+     */
+    bool canceled() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->canceled;
+    }
+
+    /**
+     * @brief Cancels the computation: tasks not started are dropped and
+     * running ones stop at their next check. Has no effect once finished.
+     *
+     */
+    void cancel()
+    {
+        state->context.cancel_group_execution();
+    }
+
+    /**
+     * @brief Registers a function called once the computation finishes, on the
+     * thread that finishes it, after poll and wait see it finished. If it has
+     * already finished, the function is not registered nor called: the result
+     * can be used at once.
+     *
+     * @param callback function receiving this handle
+     * @return true if registered, false if the computation had finished
+     */
+    bool on_complete(Callback callback) const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->done)
+        {
+            return false;
+        }
+        state->callbacks.push_back(std::move(callback));
+        return true;
+    }
+
+private:
+    friend HistogramFuture async_histogram(oneapi::tbb::task_arena &, const int *, size_t, const BinSpec &);
+
+    struct State
+    {
+        oneapi::tbb::task_group_context context;
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool done = false;
+        bool canceled = false;
+        Histogram result;
+        std::vector<Callback> callbacks;
+    };
+
+    HistogramFuture() : state(std::make_shared<State>()) {}
+
+    void finish(Histogram result, bool canceled) const
+    {
+        std::vector<Callback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->result = std::move(result);
+            state->canceled = canceled;
+            state->done = true;
+            callbacks.swap(state->callbacks);
+        }
+        state->finished.notify_all();
+        for (Callback &callback : callbacks)
+        {
+            callback(*this);
+        }
+    }
+
+    std::shared_ptr<State> state;
+};
+
+/**
+ * @brief Counts values like privatized_histogram, checking for cancellation
+ * every ASYNC_CANCEL_CHECK_VALUES values: once the task group running it is
+ * canceled, every task stops counting within a few microseconds.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @return std::vector<int64_t> with the regular histogram, partial if canceled
+ */
+inline std::vector<int64_t> cancellable_counts(const int *values, size_t n, const BinSpec &spec)
+{
+    return oneapi::tbb::parallel_reduce(
+        oneapi::tbb::blocked_range<size_t>(0, n), std::vector<int64_t>(spec.num_bins),
+        [&](const oneapi::tbb::blocked_range<size_t> &r, std::vector<int64_t> counts)
+        {
+            TRACE_CHUNK("count", r);
+            for (size_t begin = r.begin(); begin < r.end(); begin += ASYNC_CANCEL_CHECK_VALUES)
+            {
+                if (oneapi::tbb::is_current_task_group_canceling())
+                {
+                    break;
+                }
+                const size_t end = std::min(begin + ASYNC_CANCEL_CHECK_VALUES, r.end());
+                for (size_t i = begin; i < end; i++)
+                {
+                    counts[spec.bin_of(values[i])]++;
+                }
+            }
+            return counts;
+        },
+        [](std::vector<int64_t> a, const std::vector<int64_t> &b)
+        {
+            for (size_t j = 0; j < a.size(); j++)
+            {
+                a[j] += b[j];
+            }
+            return a;
+        });
+}
+
+/**
+ * @brief Starts computing a histogram in the background and returns at once.
+ * The computation is enqueued in an arena and runs in a task_group bound to
+ * the context of the handle, so canceling the handle cancels every task of
+ * the count.
+ *
+ * @param arena arena whose threads compute the histogram
+ * @param values pointer to the values, which must stay alive until it
+ * finishes
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @return HistogramFuture handle of the computation
+ */
+inline HistogramFuture async_histogram(oneapi::tbb::task_arena &arena, const int *values, size_t n, const BinSpec &spec)
+{
+    HistogramFuture future;
+    arena.enqueue([future, values, n, spec]
+                  {
+                      PROFILE_STAGE(count_timer, "async", "count");
+                      Histogram h;
+                      oneapi::tbb::task_group group(future.state->context);
+                      const bool canceled = group.run_and_wait([&]
+                                                               { h.counts = cancellable_counts(values, n, spec); }) ==
+                                            oneapi::tbb::canceled;
+                      PROFILE_STOP(count_timer);
+
+                      if (canceled)
+                      {
+                          h = Histogram();
+                      }
+                      else
+                      {
+                          PROFILE_STAGE(scan_timer, "async", "scan");
+                          h.cumulative = cumulative_sum(h.counts);
+                          PROFILE_STOP(scan_timer);
+                      }
+                      future.finish(std::move(h), canceled);
+                  });
+    return future;
+}
+
+/**
+ * @brief Starts computing the histogram of a whole vector in the background.
+ *
+ * @see async_histogram(oneapi::tbb::task_arena &, const int *, size_t, const BinSpec &)
+ * @param arena arena whose threads compute the histogram
+ * @param values values, which must stay alive until it finishes
+ * @param spec bins of the histogram
+ * @return HistogramFuture handle of the computation
+ */
+inline HistogramFuture async_histogram(oneapi::tbb::task_arena &arena, const std::vector<int> &values, const BinSpec &spec)
+{
+    return async_histogram(arena, values.data(), values.size(), spec);
+}
+
+#endif
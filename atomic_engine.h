@@ -0,0 +1,187 @@
+#ifndef ATOMIC_ENGINE_H
+#define ATOMIC_ENGINE_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/cache_aligned_allocator.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/task_arena.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Number of values looked at by the contention probe
+ *
+ */
+const size_t CONTENTION_PROBE_SAMPLES = 4096;
+
+/**
+ * @brief Counters that share a cache line, and therefore contend with each
+ * other when different threads increment them
+ *
+ */
+const int64_t COUNTERS_PER_LINE = 64 / sizeof(int64_t);
+
+/**
+ * @brief Probes how contended a shared histogram would be and chooses how many
+ * copies (shards) of it the threads should spread over. A sample of the values
+ * is binned and the hottest cache line of counters found, by sorting the lines
+ * sampled so the probe needs no memory per bin: if a fraction f of the
+ * increments go to it, about threads x f threads would be hammering it at
+ * once, so that many shards are used (rounded to a power of two). The
+ * all-in-one-bin case therefore gets one shard per thread and a uniform
+ * histogram over many bins gets a single one. The number of shards is capped
+ * by the memory budget.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param threads number of threads that will increment the histogram
+ * @param memory_budget bytes available for the shards
+ * @return int with the number of shards, at least 1
+ */
+inline int choose_shards(const int *values, size_t n, const BinSpec &spec, int threads, int64_t memory_budget)
+{
+    if (n == 0 || threads <= 1)
+    {
+        return 1;
+    }
+
+    // Count the sample per cache line of counters, not per bin: equal lines
+    // are next to each other once sorted
+    const size_t samples = std::min(n, CONTENTION_PROBE_SAMPLES);
+    const size_t stride = n / samples;
+    std::vector<int> lines(samples);
+    for (size_t s = 0; s < samples; s++)
+    {
+        lines[s] = spec.bin_of(values[s * stride]) / COUNTERS_PER_LINE;
+    }
+    std::sort(lines.begin(), lines.end());
+    int hottest = 0;
+    for (size_t s = 0, run = 0; s < samples; s++)
+    {
+        run = s > 0 && lines[s] == lines[s - 1] ? run + 1 : 1;
+        hottest = std::max(hottest, int(run));
+    }
+
+    const double contenders = double(threads) * hottest / samples;
+    int shards = 1;
+    while (shards < threads && shards < contenders)
+    {
+        shards *= 2;
+    }
+    shards = std::min(shards, threads);
+
+    const int64_t shard_bytes = (spec.num_bins + COUNTERS_PER_LINE) * int64_t(sizeof(int64_t));
+    while (shards > 1 && shards * shard_bytes > memory_budget)
+    {
+        shards /= 2;
+    }
+    return shards;
+}
+
+/**
+ * @brief Shared-bin engine: all the threads increment a shared histogram with
+ * relaxed atomic fetch-adds, so the memory needed does not grow with
+ * threads x bins as with private copies. To relieve the contention on hot
+ * bins, the histogram is split into shards (each thread uses the one of its
+ * arena slot) which are summed at the end.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param shards number of copies of the histogram, 0 to probe for it
+ * @param memory_budget bytes available for the shards when probing
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram atomic_histogram(const int *values, size_t n, const BinSpec &spec, int shards = 0,
+                                  int64_t memory_budget = INT64_MAX)
+{
+    const int threads = oneapi::tbb::info::default_concurrency();
+    if (shards <= 0)
+    {
+        PROFILE_STAGE(probe_timer, "atomic", "probe");
+        shards = choose_shards(values, n, spec, threads, memory_budget);
+    }
+
+    // Shards start on their own cache line, so they never share one: the
+    // counters are cache-line aligned and every shard takes whole lines
+    const size_t bins = spec.num_bins;
+    const size_t stride = (bins + COUNTERS_PER_LINE - 1) / COUNTERS_PER_LINE * COUNTERS_PER_LINE;
+
+    PROFILE_STAGE(count_timer, "atomic", "count");
+    using CounterAllocator = oneapi::tbb::cache_aligned_allocator<std::atomic<int64_t>>;
+    const size_t num_counters = shards * stride;
+    auto release = [num_counters](std::atomic<int64_t> *p)
+    {
+        CounterAllocator().deallocate(p, num_counters);
+    };
+    std::unique_ptr<std::atomic<int64_t>[], decltype(release)> counters(CounterAllocator().allocate(num_counters),
+                                                                         release);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, num_counters),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                new (&counters[i]) std::atomic<int64_t>(0);
+            }
+        });
+
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("count", r);
+            int slot = std::max(0, oneapi::tbb::this_task_arena::current_thread_index());
+            std::atomic<int64_t> *shard = counters.get() + (slot % shards) * stride;
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                shard[spec.bin_of(values[i])].fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(merge_timer, "atomic", "merge");
+    Histogram h;
+    h.counts.assign(bins, 0);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, bins),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (int s = 0; s < shards; s++)
+            {
+                for (size_t j = r.begin(); j < r.end(); j++)
+                {
+                    h.counts[j] += counters[s * stride + j].load(std::memory_order_relaxed);
+                }
+            }
+        });
+    PROFILE_STOP(merge_timer);
+
+    PROFILE_STAGE(scan_timer, "atomic", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Shared-bin engine over a whole vector, probing for the shards.
+ *
+ * @see atomic_histogram(const int *, size_t, const BinSpec &, int, int64_t)
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram atomic_histogram(const std::vector<int> &values, const BinSpec &spec)
+{
+    return atomic_histogram(values.data(), values.size(), spec);
+}
+
+#endif
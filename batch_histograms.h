@@ -0,0 +1,137 @@
+#ifndef BATCH_HISTOGRAMS_H
+#define BATCH_HISTOGRAMS_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Values at least as many as this are counted by a task of their own
+ * with the privatized engine; smaller arrays are packed together into tasks
+ * of about this many values, so each task is worth scheduling
+ *
+ */
+const size_t BATCH_TASK_VALUES = 16384;
+
+/**
+ * @brief Array of values owned by the caller.
+ *
+ */
+struct ValueSpan
+{
+    const int *values;
+    size_t size;
+};
+
+/**
+ * @brief Histograms of many arrays with the same bins, in one contiguous
+ * buffer: for every array, its num_bins counters followed by its num_bins
+ * cumulative counters.
+ *
+ */
+struct BatchHistograms
+{
+    BinSpec spec{1, 1};
+    std::vector<int64_t> data;
+
+    size_t size() const
+    {
+        return data.size() / (2 * size_t(spec.num_bins));
+    }
+
+    const int64_t *counts(size_t array) const
+    {
+        return data.data() + 2 * array * spec.num_bins;
+    }
+
+    const int64_t *cumulative(size_t array) const
+    {
+        return counts(array) + spec.num_bins;
+    }
+};
+
+/**
+ * @brief Histograms of many independent arrays in one parallel_for, for
+ * requests made of thousands of tiny arrays where a parallel call per array
+ * would cost more than counting it. Consecutive small arrays are packed into
+ * tasks of about BATCH_TASK_VALUES values, each counting and scanning its
+ * arrays sequentially; large arrays get a task of their own that splits them
+ * with the privatized engine.
+ *
+ * @param spans arrays of values to be classified
+ * @param spec bins of every histogram
+ * @return BatchHistograms with the regular and cumulative histogram of every
+ * array, in the order of the spans
+ */
+inline BatchHistograms batch_histograms(const std::vector<ValueSpan> &spans, const BinSpec &spec)
+{
+    PROFILE_STAGE(pack_timer, "batch", "pack");
+    BatchHistograms result;
+    result.spec = spec;
+    result.data.assign(2 * spans.size() * spec.num_bins, 0);
+
+    // Task t counts the spans from tasks[t] to tasks[t + 1]
+    std::vector<size_t> tasks = {0};
+    size_t packed = 0;
+    for (size_t s = 0; s < spans.size(); s++)
+    {
+        if (spans[s].size >= BATCH_TASK_VALUES && s > tasks.back())
+        {
+            tasks.push_back(s);
+            packed = 0;
+        }
+        packed += spans[s].size;
+        if (packed >= BATCH_TASK_VALUES)
+        {
+            tasks.push_back(s + 1);
+            packed = 0;
+        }
+    }
+    if (tasks.back() < spans.size())
+    {
+        tasks.push_back(spans.size());
+    }
+    PROFILE_STOP(pack_timer);
+
+    PROFILE_STAGE(count_timer, "batch", "count");
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, tasks.size() - 1, 1),
+        [&](const oneapi::tbb::blocked_range<size_t> &r)
+        {
+            TRACE_CHUNK("count", r);
+            for (size_t t = r.begin(); t < r.end(); t++)
+            {
+                for (size_t s = tasks[t]; s < tasks[t + 1]; s++)
+                {
+                    int64_t *counts = result.data.data() + 2 * s * spec.num_bins;
+                    int64_t *cumulative = counts + spec.num_bins;
+                    if (spans[s].size >= BATCH_TASK_VALUES)
+                    {
+                        const Histogram h = privatized_histogram(spans[s].values, spans[s].size, spec);
+                        std::copy(h.counts.begin(), h.counts.end(), counts);
+                    }
+                    else
+                    {
+                        for (size_t i = 0; i < spans[s].size; i++)
+                        {
+                            counts[spec.bin_of(spans[s].values[i])]++;
+                        }
+                    }
+                    int64_t total = 0;
+                    for (int j = 0; j < spec.num_bins; j++)
+                    {
+                        total += counts[j];
+                        cumulative[j] = total;
+                    }
+                }
+            }
+        });
+    PROFILE_STOP(count_timer);
+    return result;
+}
+
+#endif
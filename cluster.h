@@ -0,0 +1,339 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include "serialization.h"
+#include "transport.h"
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/tick_count.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief First byte of every message between the coordinator and its workers.
+ *
+ */
+enum ClusterMessage : uint8_t
+{
+    CLUSTER_TASK = 1,   // Coordinator to worker: bins and values of a shard
+    CLUSTER_RESULT = 2, // Worker to coordinator: serialized partial histogram
+    CLUSTER_STOP = 3    // Coordinator to worker: no more shards
+};
+
+/**
+ * @brief Builds the message sending a shard to a worker: the bins as varints,
+ * then the number of values as a varint and the raw values.
+ *
+ * @param spec bins of the histogram
+ * @param values pointer to the values of the shard
+ * @param n number of values
+ * @return std::vector<uint8_t> with the message
+ */
+inline std::vector<uint8_t> encode_task(const BinSpec &spec, const int *values, size_t n)
+{
+    std::vector<uint8_t> message = {CLUSTER_TASK};
+    put_varint(message, uint64_t(spec.bin_span));
+    put_varint(message, uint64_t(spec.num_bins));
+    put_varint(message, n);
+    const size_t header = message.size();
+    message.resize(header + n * sizeof(int));
+    if (n > 0)
+    {
+        std::memcpy(&message[header], values, n * sizeof(int));
+    }
+    return message;
+}
+
+/**
+ * @brief Reads a message built by encode_task.
+ *
+ * @param message bytes received
+ * @param spec bins of the histogram
+ * @param values values of the shard
+ * @return true if the message is a whole task
+ */
+inline bool decode_task(const std::vector<uint8_t> &message, BinSpec &spec, std::vector<int> &values)
+{
+    const uint8_t *data = message.data();
+    const uint8_t *end = data + message.size();
+    if (message.empty() || *data++ != CLUSTER_TASK)
+    {
+        return false;
+    }
+    uint64_t bin_span, num_bins, n;
+    if (!get_varint(data, end, bin_span) || !get_varint(data, end, num_bins) || !get_varint(data, end, n) ||
+        bin_span == 0 || bin_span > uint64_t(INT32_MAX) || num_bins == 0 || num_bins > uint64_t(INT32_MAX) ||
+        n != uint64_t(end - data) / sizeof(int) || uint64_t(end - data) % sizeof(int) != 0)
+    {
+        return false;
+    }
+    spec = BinSpec{int(bin_span), int(num_bins)};
+    values.resize(n);
+    if (n > 0)
+    {
+        std::memcpy(values.data(), data, n * sizeof(int));
+    }
+    return true;
+}
+
+/**
+ * @brief Loop of a worker process: connects to the coordinator and answers
+ * every shard with its serialized partial histogram until told to stop.
+ *
+ * @param transport transport to reach the coordinator
+ * @param address address of the coordinator
+ * @return int exit status, 0 if it stopped when told to
+ */
+inline int run_cluster_worker(Transport &transport, const std::string &address)
+{
+    std::unique_ptr<Connection> coordinator = transport.connect(address);
+    if (!coordinator)
+    {
+        return 1;
+    }
+    std::vector<uint8_t> message;
+    BinSpec spec{1, 1};
+    std::vector<int> values;
+    while (coordinator->receive(message))
+    {
+        if (!message.empty() && message[0] == CLUSTER_STOP)
+        {
+            return 0;
+        }
+        if (!decode_task(message, spec, values))
+        {
+            return 1;
+        }
+        std::vector<uint8_t> result = {CLUSTER_RESULT};
+        const std::vector<uint8_t> partial = serialize_histogram(partial_histogram(values.data(), values.size(), spec));
+        result.insert(result.end(), partial.begin(), partial.end());
+        if (!coordinator->send(result))
+        {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Merges partial histograms as a binary tree: at every level, pairs
+ * are merged in parallel, so N partials take log2(N) levels instead of N - 1
+ * merges in a row.
+ *
+ * @param partials histograms of the shards, consumed
+ * @param merged histogram of the whole dataset
+ * @return true if all the partials use the same bins
+ */
+inline bool tree_merge(std::vector<PartialHistogram> partials, PartialHistogram &merged)
+{
+    if (partials.empty())
+    {
+        return false;
+    }
+    while (partials.size() > 1)
+    {
+        std::vector<PartialHistogram> next((partials.size() + 1) / 2);
+        std::vector<char> valid(partials.size() / 2);
+        oneapi::tbb::parallel_for(size_t(0), partials.size() / 2, [&](size_t i)
+                                  {
+                                      std::vector<PartialHistogram> pair;
+                                      pair.push_back(std::move(partials[2 * i]));
+                                      pair.push_back(std::move(partials[2 * i + 1]));
+                                      valid[i] = merge_partials(pair, next[i]);
+                                  });
+        if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+        {
+            return false;
+        }
+        if (partials.size() % 2 == 1)
+        {
+            next.back() = std::move(partials.back());
+        }
+        partials.swap(next);
+    }
+    merged = std::move(partials[0]);
+    return true;
+}
+
+/**
+ * @brief Seconds the coordinator waits for its workers to connect, and
+ * milliseconds between two checks that they are still alive meanwhile
+ *
+ */
+const double CLUSTER_ACCEPT_TIMEOUT_SECONDS = 10.0;
+const int CLUSTER_ACCEPT_POLL_MS = 100;
+
+/**
+ * @brief Time spent by the coordinator on each phase of a run.
+ *
+ */
+struct ClusterTimings
+{
+    double scatter_gather = 0.0; // Sending the shards and receiving the partials
+    double merge = 0.0;          // Decoding and tree-merging the partials
+};
+
+/**
+ * @brief Coordinator that splits a dataset into shards, sends them to worker
+ * processes over a Transport and tree-merges the partial histograms they
+ * send back. Shards are dealt to the workers in rounds, one per worker, so
+ * they all count at the same time. If any worker fails during a run, every
+ * connection is closed, since the others may still have replies in flight.
+ *
+ */
+class ClusterCoordinator
+{
+public:
+    explicit ClusterCoordinator(Transport &transport) : transport(transport) {}
+
+    ~ClusterCoordinator()
+    {
+        stop();
+    }
+
+    /**
+     * @brief Starts listening for workers.
+     *
+     * @param address address to listen on
+     * @return true if listening
+     */
+    bool listen(const std::string &address)
+    {
+        listener = transport.listen(address);
+        return listener != nullptr;
+    }
+
+    /**
+     * @brief Address the workers must connect to.
+     *
+     * @return std::string with the address
+     */
+    std::string address() const
+    {
+        return listener ? listener->address() : "";
+    }
+
+    /**
+     * @brief Waits for a number of workers to connect, giving up after a
+     * timeout or as soon as a worker is known to have died before connecting.
+     *
+     * @param count number of workers
+     * @param alive checked while waiting, false once a worker has died
+     * @param timeout_seconds seconds after which it gives up
+     * @return true if all of them connected
+     */
+    bool accept_workers(int count, const std::function<bool()> &alive = std::function<bool()>(),
+                        double timeout_seconds = CLUSTER_ACCEPT_TIMEOUT_SECONDS)
+    {
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        while (int(workers.size()) < count)
+        {
+            if ((oneapi::tbb::tick_count::now() - t0).seconds() > timeout_seconds || (alive && !alive()))
+            {
+                return false;
+            }
+            if (!listener->wait_for_connection(CLUSTER_ACCEPT_POLL_MS))
+            {
+                continue;
+            }
+            std::unique_ptr<Connection> worker = listener->accept();
+            if (!worker)
+            {
+                return false;
+            }
+            workers.push_back(std::move(worker));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Computes the histogram of a dataset split into shards.
+     *
+     * @param values pointer to the values
+     * @param n number of values
+     * @param spec bins of the histogram
+     * @param shards number of shards
+     * @param result regular and cumulative histograms
+     * @param timings time spent on each phase
+     * @return true if every shard was counted and merged
+     */
+    bool run(const int *values, size_t n, const BinSpec &spec, int shards, Histogram &result, ClusterTimings &timings)
+    {
+        if (workers.empty() || shards <= 0)
+        {
+            return false;
+        }
+
+        PROFILE_STAGE(scatter_timer, "cluster", "scatter_gather");
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        std::vector<std::vector<uint8_t>> replies(shards);
+        for (int first = 0; first < shards; first += int(workers.size()))
+        {
+            const int round = std::min(int(workers.size()), shards - first);
+            for (int w = 0; w < round; w++)
+            {
+                const size_t begin = size_t(first + w) * n / shards;
+                const size_t end = size_t(first + w + 1) * n / shards;
+                if (!workers[w]->send(encode_task(spec, values + begin, end - begin)))
+                {
+                    workers.clear();
+                    return false;
+                }
+            }
+            for (int w = 0; w < round; w++)
+            {
+                if (!workers[w]->receive(replies[first + w]) || replies[first + w].empty() ||
+                    replies[first + w][0] != CLUSTER_RESULT)
+                {
+                    workers.clear();
+                    return false;
+                }
+            }
+        }
+        timings.scatter_gather = (oneapi::tbb::tick_count::now() - t0).seconds();
+        PROFILE_STOP(scatter_timer);
+
+        PROFILE_STAGE(merge_timer, "cluster", "merge");
+        oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+        std::vector<PartialHistogram> partials(shards);
+        std::vector<char> valid(shards);
+        oneapi::tbb::parallel_for(0, shards, [&](int s)
+                                  { valid[s] = deserialize_histogram(replies[s].data() + 1, replies[s].size() - 1, partials[s]); });
+        PartialHistogram merged;
+        const bool ok = std::find(valid.begin(), valid.end(), 0) == valid.end() && tree_merge(std::move(partials), merged);
+        if (ok)
+        {
+            result = to_histogram(merged);
+        }
+        timings.merge = (oneapi::tbb::tick_count::now() - t1).seconds();
+        PROFILE_STOP(merge_timer);
+        return ok;
+    }
+
+    /**
+     * @brief Tells every worker to exit and closes the connections.
+     *
+     */
+    void stop()
+    {
+        for (std::unique_ptr<Connection> &worker : workers)
+        {
+            worker->send({CLUSTER_STOP});
+        }
+        workers.clear();
+    }
+
+private:
+    Transport &transport;
+    std::unique_ptr<Listener> listener;
+    std::vector<std::unique_ptr<Connection>> workers;
+};
+
+#endif
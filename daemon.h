@@ -0,0 +1,702 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "dataset.h"
+#include "engines.h"
+#include "quantiles.h"
+#include "result_cache.h"
+#include "serialization.h"
+#include "transport.h"
+#include <oneapi/tbb/concurrent_queue.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/task_arena.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+/**
+ * @brief First byte of every request to the daemon.
+ *
+ */
+enum DaemonRequestType : uint8_t
+{
+    DAEMON_PUT = 1,       // Store the values of a dataset
+    DAEMON_HISTOGRAM = 2, // Histogram of a dataset
+    DAEMON_QUANTILES = 3, // Quantiles of the histogram of a dataset
+    DAEMON_SHUTDOWN = 4   // Stop the daemon
+};
+
+/**
+ * @brief First byte of every response of the daemon.
+ *
+ */
+enum DaemonStatus : uint8_t
+{
+    DAEMON_OK = 0,
+    DAEMON_ERROR = 1 // Malformed request, unknown dataset or out of memory
+};
+
+/**
+ * @brief Most requests answered together in one batch
+ *
+ */
+const size_t DAEMON_MAX_BATCH = 256;
+
+/**
+ * @brief Bytes of histograms the daemon keeps cached by default
+ *
+ */
+const size_t DAEMON_CACHE_BYTES = 64 << 20;
+
+/**
+ * @brief Most bins a query may ask for. Every thread counts into private
+ * histograms of this many bins, so larger ones could exhaust the memory of
+ * the daemon with a single request
+ *
+ */
+const uint64_t DAEMON_MAX_BINS = 1 << 20;
+
+/**
+ * @brief Milliseconds the daemon waits before accepting again after a failed
+ * accept, doubled on every failure in a row up to the maximum, so running out
+ * of file descriptors does not spin a core
+ *
+ */
+const int DAEMON_ACCEPT_RETRY_MS = 1;
+const int DAEMON_ACCEPT_MAX_RETRY_MS = 1000;
+
+/**
+ * @brief Request decoded by the daemon. Every request is
+ * [type][request id][dataset id], as varints after the type, followed by:
+ *
+ *  - DAEMON_PUT: the number of values and the raw values, none negative.
+ *  - DAEMON_HISTOGRAM: the bin span and number of bins.
+ *  - DAEMON_QUANTILES: the bin span, number of bins, number of fractions and
+ *    the raw fractions, as doubles.
+ *
+ * Responses are [status][request id] followed, when the status is DAEMON_OK,
+ * by the version of the dataset and: nothing for DAEMON_PUT, the serialized
+ * histogram for DAEMON_HISTOGRAM, and the raw quantiles for DAEMON_QUANTILES.
+ *
+ */
+struct DaemonRequest
+{
+    uint8_t type = 0;
+    uint64_t id = 0;
+    uint64_t dataset = 0;
+    BinSpec spec{1, 1};
+    std::vector<double> ps;
+    std::vector<int> values;
+};
+
+/**
+ * @brief Appends raw values after a varint with their number.
+ *
+ */
+template <typename T>
+inline void put_array(std::vector<uint8_t> &out, const T *values, size_t n)
+{
+    put_varint(out, n);
+    const size_t offset = out.size();
+    out.resize(offset + n * sizeof(T));
+    if (n > 0)
+    {
+        std::memcpy(&out[offset], values, n * sizeof(T));
+    }
+}
+
+/**
+ * @brief Reads raw values written by put_array.
+ *
+ */
+template <typename T>
+inline bool get_array(const uint8_t *&data, const uint8_t *end, std::vector<T> &values)
+{
+    uint64_t n;
+    if (!get_varint(data, end, n) || n > uint64_t(end - data) / sizeof(T))
+    {
+        return false;
+    }
+    values.resize(n);
+    if (n > 0)
+    {
+        std::memcpy(values.data(), data, n * sizeof(T));
+    }
+    data += n * sizeof(T);
+    return true;
+}
+
+/**
+ * @brief Encodes a request to be sent to the daemon.
+ *
+ * @param request request to be encoded
+ * @return std::vector<uint8_t> with the message
+ */
+inline std::vector<uint8_t> encode_request(const DaemonRequest &request)
+{
+    std::vector<uint8_t> out = {request.type};
+    put_varint(out, request.id);
+    put_varint(out, request.dataset);
+    if (request.type == DAEMON_PUT)
+    {
+        put_array(out, request.values.data(), request.values.size());
+    }
+    if (request.type == DAEMON_HISTOGRAM || request.type == DAEMON_QUANTILES)
+    {
+        put_varint(out, uint64_t(request.spec.bin_span));
+        put_varint(out, uint64_t(request.spec.num_bins));
+    }
+    if (request.type == DAEMON_QUANTILES)
+    {
+        put_array(out, request.ps.data(), request.ps.size());
+    }
+    return out;
+}
+
+/**
+ * @brief Decodes a request received by the daemon.
+ *
+ * @param message bytes received
+ * @param request request decoded
+ * @return true if the message is a whole request; its id is filled in as
+ * soon as it is read, so that even malformed requests can be answered
+ */
+inline bool decode_request(const std::vector<uint8_t> &message, DaemonRequest &request)
+{
+    const uint8_t *data = message.data();
+    const uint8_t *end = data + message.size();
+    if (message.empty())
+    {
+        return false;
+    }
+    request.type = *data++;
+    if (!get_varint(data, end, request.id) || !get_varint(data, end, request.dataset))
+    {
+        return false;
+    }
+    // Negative values have no bin, so they are rejected before being stored
+    if (request.type == DAEMON_PUT &&
+        (!get_array(data, end, request.values) ||
+         std::any_of(request.values.begin(), request.values.end(), [](int value)
+                     { return value < 0; })))
+    {
+        return false;
+    }
+    if (request.type == DAEMON_HISTOGRAM || request.type == DAEMON_QUANTILES)
+    {
+        uint64_t bin_span, num_bins;
+        if (!get_varint(data, end, bin_span) || !get_varint(data, end, num_bins) || bin_span == 0 ||
+            bin_span > uint64_t(INT32_MAX) || num_bins == 0 || num_bins > DAEMON_MAX_BINS)
+        {
+            return false;
+        }
+        request.spec = BinSpec{int(bin_span), int(num_bins)};
+    }
+    if (request.type == DAEMON_QUANTILES && !get_array(data, end, request.ps))
+    {
+        return false;
+    }
+    return data == end && request.type >= DAEMON_PUT && request.type <= DAEMON_SHUTDOWN;
+}
+
+/**
+ * @brief Long-running process that keeps datasets and a warm TBB arena
+ * resident and answers histogram and quantile requests over a Transport,
+ * typically a Unix socket.
+ *
+ * Every client connection has a thread that decodes its requests into a queue;
+ * once the client disconnects, the thread is joined and the connection
+ * released the next time the acceptor wakes up. A single dispatcher thread
+ * takes every request waiting in the queue as one batch: requests for the same
+ * histogram (same dataset version and bins) are computed once, and the
+ * distinct histograms of the batch are computed in parallel in the arena. The
+ * more concurrent requests there are, the more of them share work. Histograms
+ * are also cached across batches, until their dataset changes.
+ *
+ */
+class HistogramDaemon
+{
+public:
+    explicit HistogramDaemon(Transport &transport, int threads = oneapi::tbb::info::default_concurrency(),
+                             size_t cache_bytes = DAEMON_CACHE_BYTES)
+        : transport(transport), arena(threads), cache(cache_bytes) {}
+
+    ~HistogramDaemon()
+    {
+        stop();
+        wait();
+    }
+
+    /**
+     * @brief Starts listening and serving. The arena is initialized and its
+     * workers spun up now, so the first request does not pay for it.
+     *
+     * @param address address to listen on
+     * @return true if listening
+     */
+    bool start(const std::string &address)
+    {
+        listener = transport.listen(address);
+        if (!listener)
+        {
+            return false;
+        }
+        arena.initialize();
+        arena.execute([]
+                      { oneapi::tbb::parallel_for(0, oneapi::tbb::info::default_concurrency(), [](int) {}); });
+        acceptor = std::thread([this]
+                               { accept_loop(); });
+        dispatcher = std::thread([this]
+                                 { dispatch_loop(); });
+        return true;
+    }
+
+    /**
+     * @brief Address clients connect to.
+     *
+     * @return std::string with the address
+     */
+    std::string address() const
+    {
+        return listener ? listener->address() : "";
+    }
+
+    /**
+     * @brief Datasets of the daemon, which can also be loaded in-process.
+     *
+     * @return DatasetStore& with the datasets
+     */
+    DatasetStore &datasets()
+    {
+        return store;
+    }
+
+    /**
+     * @brief Histograms cached by the daemon.
+     *
+     * @return HistogramCache& with the histograms
+     */
+    HistogramCache &histograms()
+    {
+        return cache;
+    }
+
+    /**
+     * @brief Blocks until a client asks the daemon to shut down, or stop is
+     * called, and every thread has finished.
+     *
+     */
+    void wait()
+    {
+        if (dispatcher.joinable())
+        {
+            dispatcher.join();
+        }
+        if (acceptor.joinable())
+        {
+            acceptor.join();
+        }
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        for (Session &session : sessions)
+        {
+            session.reader.join();
+        }
+        sessions.clear();
+    }
+
+    /**
+     * @brief Stops accepting connections and closes the current ones.
+     *
+     */
+    void stop()
+    {
+        if (stopping.exchange(true) || !listener)
+        {
+            return;
+        }
+
+        // Wake the acceptor and the dispatcher up, so they see they must stop
+        transport.connect(listener->address());
+        queue.push(Pending{nullptr, DaemonRequest()});
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        for (Session &session : sessions)
+        {
+            session.connection->shutdown();
+        }
+    }
+
+private:
+    struct Pending
+    {
+        std::shared_ptr<Connection> session;
+        DaemonRequest request;
+    };
+
+    // Connection of a client and the thread reading its requests
+    struct Session
+    {
+        std::shared_ptr<Connection> connection;
+        std::thread reader;
+        std::atomic<bool> finished{false};
+    };
+
+    void accept_loop()
+    {
+        int retry_ms = DAEMON_ACCEPT_RETRY_MS;
+        while (!stopping)
+        {
+            std::shared_ptr<Connection> connection(listener->accept().release());
+            std::unique_lock<std::mutex> lock(sessions_mutex);
+            reap_sessions();
+            if (stopping)
+            {
+                break;
+            }
+            if (!connection)
+            {
+                // Out of descriptors or another transient error: back off
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+                retry_ms = std::min(2 * retry_ms, DAEMON_ACCEPT_MAX_RETRY_MS);
+                continue;
+            }
+            retry_ms = DAEMON_ACCEPT_RETRY_MS;
+            sessions.emplace_back();
+            Session &session = sessions.back();
+            session.connection = std::move(connection);
+            session.reader = std::thread([this, &session]
+                                         { read_loop(session); });
+        }
+    }
+
+    // Joins the readers of the clients that have disconnected and drops their
+    // connections, which close once their last request has been answered
+    void reap_sessions()
+    {
+        for (auto it = sessions.begin(); it != sessions.end();)
+        {
+            if (it->finished.load(std::memory_order_acquire))
+            {
+                it->reader.join();
+                it = sessions.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    void read_loop(Session &session)
+    {
+        std::vector<uint8_t> message;
+        while (!stopping && session.connection->receive(message))
+        {
+            Pending pending{session.connection, DaemonRequest()};
+            if (!decode_request(message, pending.request))
+            {
+                pending.request.type = 0; // Answered with DAEMON_ERROR
+            }
+            queue.push(std::move(pending));
+        }
+        session.finished.store(true, std::memory_order_release);
+    }
+
+    void dispatch_loop()
+    {
+        std::vector<Pending> batch;
+        while (!stopping)
+        {
+            batch.clear();
+            Pending pending;
+            queue.pop(pending);
+            batch.push_back(std::move(pending));
+            while (batch.size() < DAEMON_MAX_BATCH && queue.try_pop(pending))
+            {
+                batch.push_back(std::move(pending));
+            }
+            process(batch);
+        }
+    }
+
+    /**
+     * @brief Answers a batch in order. Runs of queries are answered together;
+     * a put or a shutdown ends a run, so queries sent after a put by the same
+     * client always see it.
+     *
+     */
+    void process(std::vector<Pending> &batch)
+    {
+        size_t first = 0;
+        for (size_t i = 0; i <= batch.size(); i++)
+        {
+            const bool query = i < batch.size() && (batch[i].request.type == DAEMON_HISTOGRAM ||
+                                                    batch[i].request.type == DAEMON_QUANTILES);
+            if (query)
+            {
+                continue;
+            }
+            answer_queries(batch, first, i);
+            first = i + 1;
+            if (i == batch.size() || !batch[i].session)
+            {
+                continue;
+            }
+
+            const DaemonRequest &request = batch[i].request;
+            std::vector<uint8_t> response = {DAEMON_OK};
+            put_varint(response, request.id);
+            if (request.type == DAEMON_PUT)
+            {
+                put_varint(response, store.put(request.dataset, request.values));
+                cache.invalidate(request.dataset);
+            }
+            else if (request.type != DAEMON_SHUTDOWN)
+            {
+                response[0] = DAEMON_ERROR;
+            }
+            batch[i].session->send(response);
+            if (request.type == DAEMON_SHUTDOWN)
+            {
+                stop();
+            }
+        }
+    }
+
+    void answer_queries(std::vector<Pending> &batch, size_t first, size_t last)
+    {
+        if (first >= last)
+        {
+            return;
+        }
+
+        // Each distinct (dataset version, bins) is computed once
+        using Key = std::tuple<const Dataset *, int, int>;
+        std::map<Key, size_t> index;
+        std::vector<std::shared_ptr<const Dataset>> datasets;
+        std::vector<BinSpec> specs;
+        std::vector<size_t> computation(last - first);
+        for (size_t i = first; i < last; i++)
+        {
+            const DaemonRequest &request = batch[i].request;
+            std::shared_ptr<const Dataset> dataset = store.get(request.dataset);
+            if (!dataset)
+            {
+                computation[i - first] = SIZE_MAX;
+                continue;
+            }
+            auto inserted = index.emplace(Key(dataset.get(), request.spec.bin_span, request.spec.num_bins), specs.size());
+            if (inserted.second)
+            {
+                datasets.push_back(dataset);
+                specs.push_back(request.spec);
+            }
+            computation[i - first] = inserted.first->second;
+        }
+
+        // Only those not cached are counted, in parallel
+        std::vector<std::shared_ptr<const Histogram>> histograms(specs.size());
+        std::vector<size_t> missing;
+        for (size_t c = 0; c < specs.size(); c++)
+        {
+            histograms[c] = cache.find(datasets[c]->id, datasets[c]->version, specs[c]);
+            if (!histograms[c])
+            {
+                missing.push_back(c);
+            }
+        }
+        // A histogram that does not fit in memory is answered with an error
+        // instead of taking the daemon down
+        arena.execute([&]
+                      { oneapi::tbb::parallel_for(size_t(0), missing.size(), [&](size_t m)
+                                                  {
+                                                      const size_t c = missing[m];
+                                                      try
+                                                      {
+                                                          histograms[c] = std::make_shared<const Histogram>(
+                                                              privatized_histogram(datasets[c]->values, specs[c]));
+                                                          cache.insert(datasets[c]->id, datasets[c]->version,
+                                                                       specs[c], ValueFilter(), histograms[c]);
+                                                      }
+                                                      catch (const std::bad_alloc &)
+                                                      {
+                                                          histograms[c] = nullptr;
+                                                      }
+                                                  }); });
+
+        for (size_t i = first; i < last; i++)
+        {
+            const DaemonRequest &request = batch[i].request;
+            const size_t c = computation[i - first];
+            const bool computed = c != SIZE_MAX && histograms[c];
+            std::vector<uint8_t> response = {computed ? DAEMON_OK : DAEMON_ERROR};
+            put_varint(response, request.id);
+            if (computed)
+            {
+                put_varint(response, datasets[c]->version);
+                if (request.type == DAEMON_HISTOGRAM)
+                {
+                    PartialHistogram partial;
+                    partial.spec = specs[c];
+                    partial.counts = histograms[c]->counts;
+                    const std::vector<uint8_t> serialized = serialize_histogram(partial);
+                    response.insert(response.end(), serialized.begin(), serialized.end());
+                }
+                else
+                {
+                    const std::vector<double> values = quantiles(*histograms[c], specs[c], request.ps);
+                    put_array(response, values.data(), values.size());
+                }
+            }
+            batch[i].session->send(response);
+        }
+    }
+
+    Transport &transport;
+    oneapi::tbb::task_arena arena;
+    DatasetStore store;
+    HistogramCache cache;
+    std::unique_ptr<Listener> listener;
+    oneapi::tbb::concurrent_bounded_queue<Pending> queue;
+    std::atomic<bool> stopping{false};
+    std::thread acceptor;
+    std::thread dispatcher;
+    std::mutex sessions_mutex;
+    std::list<Session> sessions;
+};
+
+/**
+ * @brief Client of a HistogramDaemon. Calls block until their response
+ * arrives; concurrent callers should use a client each.
+ *
+ */
+class DaemonClient
+{
+public:
+    explicit DaemonClient(Transport &transport) : transport(transport) {}
+
+    /**
+     * @brief Connects to a daemon.
+     *
+     * @param address address of the daemon
+     * @return true if connected
+     */
+    bool connect(const std::string &address)
+    {
+        connection = transport.connect(address);
+        return connection != nullptr;
+    }
+
+    /**
+     * @brief Stores the values of a dataset in the daemon.
+     *
+     * @param dataset id of the dataset
+     * @param values values of the dataset
+     * @param version new version of the dataset
+     * @return true if stored
+     */
+    bool put(uint64_t dataset, const std::vector<int> &values, uint64_t &version)
+    {
+        DaemonRequest request;
+        request.type = DAEMON_PUT;
+        request.dataset = dataset;
+        request.values = values;
+        const uint8_t *data, *end;
+        return call(request, data, end) && get_varint(data, end, version);
+    }
+
+    /**
+     * @brief Asks for the histogram of a dataset.
+     *
+     * @param dataset id of the dataset
+     * @param spec bins of the histogram
+     * @param result regular and cumulative histograms
+     * @param version version of the dataset they were computed from
+     * @return true if the daemon answered with the histogram
+     */
+    bool histogram(uint64_t dataset, const BinSpec &spec, Histogram &result, uint64_t &version)
+    {
+        DaemonRequest request;
+        request.type = DAEMON_HISTOGRAM;
+        request.dataset = dataset;
+        request.spec = spec;
+        const uint8_t *data, *end;
+        PartialHistogram partial;
+        if (!call(request, data, end) || !get_varint(data, end, version) ||
+            !deserialize_histogram(data, size_t(end - data), partial))
+        {
+            return false;
+        }
+        result = to_histogram(partial);
+        return true;
+    }
+
+    /**
+     * @brief Asks for quantiles of the histogram of a dataset.
+     *
+     * @param dataset id of the dataset
+     * @param spec bins of the histogram
+     * @param ps fractions of the values, between 0 and 1
+     * @param values a value per fraction
+     * @param version version of the dataset they were computed from
+     * @return true if the daemon answered with the quantiles
+     */
+    bool quantiles(uint64_t dataset, const BinSpec &spec, const std::vector<double> &ps, std::vector<double> &values,
+                   uint64_t &version)
+    {
+        DaemonRequest request;
+        request.type = DAEMON_QUANTILES;
+        request.dataset = dataset;
+        request.spec = spec;
+        request.ps = ps;
+        const uint8_t *data, *end;
+        return call(request, data, end) && get_varint(data, end, version) && get_array(data, end, values);
+    }
+
+    /**
+     * @brief Asks the daemon to stop.
+     *
+     * @return true if it acknowledged
+     */
+    bool shutdown()
+    {
+        DaemonRequest request;
+        request.type = DAEMON_SHUTDOWN;
+        const uint8_t *data, *end;
+        return call(request, data, end);
+    }
+
+private:
+    bool call(DaemonRequest &request, const uint8_t *&data, const uint8_t *&end)
+    {
+        request.id = ++last_id;
+        uint64_t id;
+        if (!connection || !connection->send(encode_request(request)) || !connection->receive(response) ||
+            response.empty() || response[0] != DAEMON_OK)
+        {
+            return false;
+        }
+        data = response.data() + 1;
+        end = response.data() + response.size();
+        return get_varint(data, end, id) && id == request.id;
+    }
+
+    Transport &transport;
+    std::unique_ptr<Connection> connection;
+    std::vector<uint8_t> response;
+    uint64_t last_id = 0;
+};
+
+#endif
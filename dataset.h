@@ -0,0 +1,66 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Values kept resident to be histogrammed many times. Every change
+ * creates a new version, so results computed from an older one can be told
+ * apart.
+ *
+ */
+struct Dataset
+{
+    uint64_t id;
+    uint64_t version;
+    std::vector<int> values;
+};
+
+/**
+ * @brief Datasets of a long-running process, by id. Datasets are immutable
+ * once stored: a change stores a new Dataset with the next version, so a
+ * computation holding the previous one can finish with it undisturbed.
+ *
+ */
+class DatasetStore
+{
+public:
+    /**
+     * @brief Stores the values of a dataset, replacing any previous ones.
+     *
+     * @param id id of the dataset
+     * @param values values of the dataset
+     * @return uint64_t with the new version, 1 for a new dataset
+     */
+    uint64_t put(uint64_t id, std::vector<int> values)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<const Dataset> &slot = datasets[id];
+        const uint64_t version = slot ? slot->version + 1 : 1;
+        slot = std::make_shared<const Dataset>(Dataset{id, version, std::move(values)});
+        return version;
+    }
+
+    /**
+     * @brief Returns the current version of a dataset.
+     *
+     * @param id id of the dataset
+     * @return std::shared_ptr<const Dataset> null if there is no such dataset
+     */
+    std::shared_ptr<const Dataset> get(uint64_t id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = datasets.find(id);
+        return found == datasets.end() ? nullptr : found->second;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<uint64_t, std::shared_ptr<const Dataset>> datasets;
+};
+
+#endif
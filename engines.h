@@ -0,0 +1,392 @@
+#ifndef ENGINES_H
+#define ENGINES_H
+
+#include "instrumentation.h"
+#include "memory_estimate.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/concurrent_queue.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_pipeline.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/parallel_scan.h>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Equal-width bins chosen at run time. As in parallel_solution, the
+ * first bin goes from 0 to bin_span (both included), every other bin covers
+ * the next bin_span values, and the last one also takes any larger value.
+ *
+ */
+struct BinSpec
+{
+    int bin_span;
+    int num_bins;
+
+    /**
+     * @brief Bin a value falls into.
+     *
+     * @param value non-negative integer to be classified
+     * @return int with the index of its bin
+     */
+    int bin_of(int value) const
+    {
+        int val = value > 0 ? value - 1 : value; // 0 belongs in the first bin
+        return std::min(val / bin_span, num_bins - 1);
+    }
+
+    bool operator==(const BinSpec &other) const
+    {
+        return bin_span == other.bin_span && num_bins == other.num_bins;
+    }
+};
+
+/**
+ * @brief Regular and cumulative histogram computed by an engine. Counters are
+ * 64-bit so inputs larger than 2^31 values can be counted.
+ *
+ */
+struct Histogram
+{
+    std::vector<int64_t> counts;
+    std::vector<int64_t> cumulative;
+
+    /**
+     * @brief Number of values in the histogram.
+     *
+     * @return int64_t with the last element of the cumulative histogram
+     */
+    int64_t total() const
+    {
+        return cumulative.empty() ? 0 : cumulative.back();
+    }
+};
+
+/**
+ * @brief Scans the regular histogram to build the cumulative one, with the
+ * same parallel_scan as parallel_solution.
+ *
+ * @param counts regular histogram
+ * @return std::vector<int64_t> with the cumulative histogram
+ */
+inline std::vector<int64_t> cumulative_sum(const std::vector<int64_t> &counts)
+{
+    std::vector<int64_t> cumulative(counts.size());
+    oneapi::tbb::parallel_scan(
+        oneapi::tbb::blocked_range<size_t>(0, counts.size()),
+        int64_t(0),
+        [&](oneapi::tbb::blocked_range<size_t> r, int64_t total, bool is_final_scan)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                total += counts[i];
+                if (is_final_scan)
+                {
+                    cumulative[i] = total;
+                }
+            }
+            return total;
+        },
+        [](int64_t x, int64_t y)
+        {
+            return x + y;
+        });
+    return cumulative;
+}
+
+/**
+ * @brief Reference engine: the three steps of parallel_solution (map, reduce
+ * and scan) with the number of bins chosen at run time. It keeps one row of
+ * num_bins counters per value, so it needs num_bins times the input.
+ *
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram three_stage_histogram(const std::vector<int> &values, const BinSpec &spec)
+{
+    const size_t n = values.size();
+    const size_t bins = spec.num_bins;
+
+    PROFILE_STAGE(map_timer, "parallel", "map");
+    std::vector<int> mapped_values(n * bins);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("map", r);
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                mapped_values[i * bins + spec.bin_of(values[i])] = 1;
+            }
+        });
+    PROFILE_STOP(map_timer);
+
+    PROFILE_STAGE(reduce_timer, "parallel", "reduce");
+    Histogram h;
+    h.counts = oneapi::tbb::parallel_reduce(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        std::vector<int64_t>(bins),
+        [&](oneapi::tbb::blocked_range<size_t> r, std::vector<int64_t> total)
+        {
+            TRACE_CHUNK("reduce", r);
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                for (size_t j = 0; j < bins; j++)
+                {
+                    total[j] += mapped_values[i * bins + j];
+                }
+            }
+            return total;
+        },
+        [&](std::vector<int64_t> left, const std::vector<int64_t> &right)
+        {
+            for (size_t j = 0; j < bins; j++)
+            {
+                left[j] += right[j];
+            }
+            return left;
+        });
+    PROFILE_STOP(reduce_timer);
+
+    PROFILE_STAGE(scan_timer, "parallel", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Sequential version of three_stage_histogram, as sequential_solution
+ * is of parallel_solution.
+ *
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram sequential_histogram(const std::vector<int> &values, const BinSpec &spec)
+{
+    const size_t n = values.size();
+    const size_t bins = spec.num_bins;
+
+    PROFILE_STAGE(map_timer, "sequential", "map");
+    std::vector<int> mapped_values(n * bins);
+    for (size_t i = 0; i < n; i++)
+    {
+        mapped_values[i * bins + spec.bin_of(values[i])] = 1;
+    }
+    PROFILE_STOP(map_timer);
+
+    PROFILE_STAGE(reduce_timer, "sequential", "reduce");
+    Histogram h;
+    h.counts.assign(bins, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < bins; j++)
+        {
+            h.counts[j] += mapped_values[i * bins + j];
+        }
+    }
+    PROFILE_STOP(reduce_timer);
+
+    PROFILE_STAGE(scan_timer, "sequential", "scan");
+    h.cumulative.resize(bins);
+    int64_t total = 0;
+    for (size_t j = 0; j < bins; j++)
+    {
+        total += h.counts[j];
+        h.cumulative[j] = total;
+    }
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Body of parallel_reduce that counts a range of values straight into
+ * a private histogram, fusing the map and reduce steps: no mapped values are
+ * stored, and each subrange only allocates one array of num_bins counters.
+ *
+ */
+class PrivateCounts
+{
+public:
+    PrivateCounts(const int *values, const BinSpec &spec)
+        : counts(spec.num_bins), values(values), spec(spec) {}
+
+    PrivateCounts(PrivateCounts &other, oneapi::tbb::split)
+        : counts(other.spec.num_bins), values(other.values), spec(other.spec) {}
+
+    void operator()(const oneapi::tbb::blocked_range<size_t> &r)
+    {
+        TRACE_CHUNK("count", r);
+        for (size_t i = r.begin(); i < r.end(); i++)
+        {
+            counts[spec.bin_of(values[i])]++;
+        }
+    }
+
+    void join(const PrivateCounts &other)
+    {
+        for (size_t j = 0; j < counts.size(); j++)
+        {
+            counts[j] += other.counts[j];
+        }
+    }
+
+    std::vector<int64_t> counts;
+
+private:
+    const int *values;
+    BinSpec spec;
+};
+
+/**
+ * @brief Privatized engine: every task counts its values into its own
+ * histogram (map and reduce fused into a single parallel_reduce) and the
+ * private histograms are summed when the tasks join. It only needs a few
+ * arrays of num_bins counters per thread on top of the input.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram privatized_histogram(const int *values, size_t n, const BinSpec &spec)
+{
+    PROFILE_STAGE(count_timer, "privatized", "count");
+    PrivateCounts body(values, spec);
+    oneapi::tbb::parallel_reduce(oneapi::tbb::blocked_range<size_t>(0, n), body);
+    Histogram h;
+    h.counts = std::move(body.counts);
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(scan_timer, "privatized", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Privatized engine over a whole vector.
+ *
+ * @see privatized_histogram(const int *, size_t, const BinSpec &)
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram privatized_histogram(const std::vector<int> &values, const BinSpec &spec)
+{
+    return privatized_histogram(values.data(), values.size(), spec);
+}
+
+/**
+ * @brief Producer of the values for the streaming engine. It fills the buffer
+ * with up to capacity values and returns how many it wrote, 0 once there are
+ * no more values.
+ *
+ */
+using ValueSource = std::function<size_t(int *buffer, size_t capacity)>;
+
+/**
+ * @brief Streaming engine: reads the values block by block from a source and
+ * counts the blocks in parallel with a parallel_pipeline (read, count, add),
+ * so the input never has to be in memory at once. Only a few blocks, each
+ * with its own histogram, are alive at any moment.
+ *
+ * @param source producer of the values
+ * @param spec bins of the histogram
+ * @param block_size number of values read at once
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram streaming_histogram(const ValueSource &source, const BinSpec &spec, size_t block_size = STREAMING_BLOCK_VALUES)
+{
+    struct Block
+    {
+        std::vector<int> values;
+        size_t size = 0;
+        std::vector<int64_t> counts;
+    };
+
+    // Blocks are recycled: there are as many as tokens in the pipeline
+    const size_t tokens = size_t(STREAMING_BLOCKS_IN_FLIGHT) * oneapi::tbb::info::default_concurrency();
+    std::vector<std::unique_ptr<Block>> blocks;
+    oneapi::tbb::concurrent_queue<Block *> free_blocks;
+    for (size_t t = 0; t < tokens; t++)
+    {
+        blocks.emplace_back(new Block{std::vector<int>(block_size), 0, std::vector<int64_t>(spec.num_bins)});
+        free_blocks.push(blocks.back().get());
+    }
+
+    PROFILE_STAGE(count_timer, "streaming", "count");
+    Histogram h;
+    h.counts.assign(spec.num_bins, 0);
+    oneapi::tbb::parallel_pipeline(
+        tokens,
+        oneapi::tbb::make_filter<void, Block *>(
+            oneapi::tbb::filter_mode::serial_in_order,
+            [&](oneapi::tbb::flow_control &fc) -> Block *
+            {
+                Block *block = nullptr;
+                free_blocks.try_pop(block);
+                block->size = source(block->values.data(), block_size);
+                if (block->size == 0)
+                {
+                    free_blocks.push(block);
+                    fc.stop();
+                    return nullptr;
+                }
+                return block;
+            }) &
+            oneapi::tbb::make_filter<Block *, Block *>(
+                oneapi::tbb::filter_mode::parallel,
+                [&](Block *block)
+                {
+                    TRACE_CHUNK("count", oneapi::tbb::blocked_range<size_t>(0, block->size));
+                    std::fill(block->counts.begin(), block->counts.end(), 0);
+                    for (size_t i = 0; i < block->size; i++)
+                    {
+                        block->counts[spec.bin_of(block->values[i])]++;
+                    }
+                    return block;
+                }) &
+            oneapi::tbb::make_filter<Block *, void>(
+                oneapi::tbb::filter_mode::serial_out_of_order,
+                [&](Block *block)
+                {
+                    for (size_t j = 0; j < h.counts.size(); j++)
+                    {
+                        h.counts[j] += block->counts[j];
+                    }
+                    free_blocks.push(block);
+                }));
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(scan_timer, "streaming", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Source that streams the values of a vector, to run the streaming
+ * engine over data already in memory.
+ *
+ * @param values vector to be streamed, which must outlive the source
+ * @return ValueSource reading the vector from the beginning
+ */
+inline ValueSource vector_source(const std::vector<int> &values)
+{
+    std::shared_ptr<size_t> position(new size_t(0));
+    return [&values, position](int *buffer, size_t capacity)
+    {
+        size_t count = std::min(capacity, values.size() - *position);
+        std::copy(values.begin() + *position, values.begin() + *position + count, buffer);
+        *position += count;
+        return count;
+    };
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef EQUI_DEPTH_H
+#define EQUI_DEPTH_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include "quantiles.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Bins of the fine histogram the equi-depth edges are chosen from. The
+ * counts of the bins built are exact, but their edges can only fall between
+ * fine bins, so the more fine bins the closer to equal the counts get.
+ *
+ */
+const int64_t EQUI_DEPTH_FINE_BINS = 1 << 16;
+
+/**
+ * @brief Bins with approximately the same number of values each. Bin i holds
+ * the values in [edges[i], edges[i + 1]), so there is one more edge than
+ * bins, and the last edge is one past the largest value.
+ *
+ */
+struct EquiDepthBins
+{
+    std::vector<int64_t> edges;
+    std::vector<int64_t> counts;
+    std::vector<int64_t> cumulative;
+
+    /**
+     * @brief Bin a value falls into.
+     *
+     * @param value integer between the first and the last edge
+     * @return int with the index of its bin
+     */
+    int bin_of(int value) const
+    {
+        size_t bin = std::upper_bound(edges.begin(), edges.end(), int64_t(value)) - edges.begin();
+        return int(std::min(std::max<size_t>(bin, 1), counts.size()) - 1);
+    }
+};
+
+/**
+ * @brief Builds bins with approximately equal counts instead of equal widths,
+ * without sorting the values:
+ *
+ *  1. Range: the smallest and largest values, with a parallel_reduce.
+ *  2. Fine histogram: the values are counted into EQUI_DEPTH_FINE_BINS
+ *     equal-width bins over that range (one per value if the range is
+ *     smaller), with private counts per thread, and scanned.
+ *  3. Select: the edge of the k-th bin is the boundary between fine bins
+ *     whose cumulative count is the closest to k x n / num_bins, found with a
+ *     binary search over the fine cumulative histogram.
+ *
+ * A single value repeated more than n / num_bins times cannot be split, so
+ * edges that would coincide are merged and fewer bins may be returned.
+ *
+ * @param values array of integers with the values to be classified
+ * @param num_bins number of bins wanted
+ * @return EquiDepthBins with the edges, counts and cumulative counts
+ */
+inline EquiDepthBins equi_depth_bins(const std::vector<int> &values, int num_bins)
+{
+    EquiDepthBins result;
+    const size_t n = values.size();
+    if (n == 0 || num_bins <= 0)
+    {
+        return result;
+    }
+
+    PROFILE_STAGE(range_timer, "equi_depth", "range");
+    using Range = std::pair<int64_t, int64_t>;
+    const Range range = oneapi::tbb::parallel_reduce(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        Range(INT64_MAX, INT64_MIN),
+        [&](oneapi::tbb::blocked_range<size_t> r, Range total)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                total.first = std::min<int64_t>(total.first, values[i]);
+                total.second = std::max<int64_t>(total.second, values[i]);
+            }
+            return total;
+        },
+        [](Range left, Range right)
+        {
+            return Range(std::min(left.first, right.first), std::max(left.second, right.second));
+        });
+    PROFILE_STOP(range_timer);
+
+    PROFILE_STAGE(fine_timer, "equi_depth", "fine");
+    const int64_t lowest = range.first;
+    const int64_t span = range.second - lowest + 1;
+    const int64_t width = (span + EQUI_DEPTH_FINE_BINS - 1) / EQUI_DEPTH_FINE_BINS;
+    const size_t fine_bins = size_t((span + width - 1) / width);
+    oneapi::tbb::enumerable_thread_specific<std::vector<int64_t>> locals(fine_bins, 0);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("fine", r);
+            std::vector<int64_t> &local = locals.local();
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                local[size_t((values[i] - lowest) / width)]++;
+            }
+        });
+    std::vector<int64_t> fine(fine_bins, 0);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, fine_bins),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (const std::vector<int64_t> &local : locals)
+            {
+                for (size_t j = r.begin(); j < r.end(); j++)
+                {
+                    fine[j] += local[j];
+                }
+            }
+        });
+    const std::vector<int64_t> fine_cumulative = cumulative_sum(fine);
+    PROFILE_STOP(fine_timer);
+
+    PROFILE_STAGE(select_timer, "equi_depth", "select");
+    // Fine bins after which a bin ends; the last one ends after all of them
+    std::vector<size_t> ends;
+    for (int k = 1; k < num_bins; k++)
+    {
+        const double target = double(k) * n / num_bins;
+        size_t f = branchless_lower_bound(fine_cumulative.data(), fine_bins, target);
+        if (f > 0 && target - fine_cumulative[f - 1] < fine_cumulative[f] - target)
+        {
+            f--;
+        }
+        if (f + 1 < fine_bins && (ends.empty() || f > ends.back()) && fine_cumulative[f] > 0)
+        {
+            ends.push_back(f);
+        }
+    }
+    ends.push_back(fine_bins - 1);
+
+    result.edges.push_back(lowest);
+    int64_t previous = 0;
+    for (size_t f : ends)
+    {
+        result.edges.push_back(std::min(lowest + int64_t(f + 1) * width, range.second + 1));
+        result.counts.push_back(fine_cumulative[f] - previous);
+        result.cumulative.push_back(fine_cumulative[f]);
+        previous = fine_cumulative[f];
+    }
+    PROFILE_STOP(select_timer);
+    return result;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef HISTOGRAM_AWAITABLE_H
+#define HISTOGRAM_AWAITABLE_H
+
+#include "async_histogram.h"
+#include <functional>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define COROUTINES_SUPPORTED 1
+#else
+#define COROUTINES_SUPPORTED 0
+#endif
+
+#if COROUTINES_SUPPORTED
+/**
+ * @brief Runs a function somewhere else, such as the event loop of the
+ * caller. Coroutines awaiting a histogram are resumed through it.
+ *
+ */
+using Executor = std::function<void(std::function<void()>)>;
+
+/**
+ * @brief Awaitable of a histogram computed in the background, so coroutines
+ * can co_await it without blocking a thread while it is counted. The
+ * coroutine is resumed by the TBB thread that finishes the histogram or, if
+ * an executor is given, by whatever the executor runs it on.
+ *
+ * co_await gives a copy of the histogram, empty if it was canceled.
+ *
+ */
+class HistogramAwaitable
+{
+public:
+    explicit HistogramAwaitable(HistogramFuture future, Executor executor = Executor())
+        : future(std::move(future)), executor(std::move(executor)) {}
+
+    bool await_ready() const
+    {
+        return future.poll();
+    }
+
+    // If the histogram finished after await_ready, the coroutine is not
+    // suspended: resuming it from here could destroy its frame while
+    // await_suspend is still running on it
+    bool await_suspend(std::coroutine_handle<> coroutine)
+    {
+        return future.on_complete([coroutine, executor = executor](const HistogramFuture &)
+                                  {
+                                      if (executor)
+                                      {
+                                          executor([coroutine]
+                                                   { coroutine.resume(); });
+                                      }
+                                      else
+                                      {
+                                          coroutine.resume();
+                                      }
+                                  });
+    }
+
+    Histogram await_resume() const
+    {
+        return future.get();
+    }
+
+    /**
+     * @brief Handle of the computation, to poll or cancel it.
+     *
+     * @return HistogramFuture& with the handle
+     */
+    HistogramFuture &handle()
+    {
+        return future;
+    }
+
+private:
+    HistogramFuture future;
+    Executor executor;
+};
+
+/**
+ * @brief Starts computing the histogram of a vector in the background, to be
+ * awaited by a coroutine.
+ *
+ * @param arena arena whose threads compute the histogram
+ * @param values values, which must stay alive until it finishes
+ * @param spec bins of the histogram
+ * @param executor where to resume the coroutine, by default the TBB thread
+ * that finishes the histogram
+ * @return HistogramAwaitable to be co_awaited
+ */
+inline HistogramAwaitable await_histogram(oneapi::tbb::task_arena &arena, const std::vector<int> &values,
+                                          const BinSpec &spec, Executor executor = Executor())
+{
+    return HistogramAwaitable(async_histogram(arena, values, spec), std::move(executor));
+}
+#endif
+
+#endif
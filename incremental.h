@@ -0,0 +1,197 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/parallel_scan.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Change of one value of the vector, in place.
+ *
+ */
+struct ValueUpdate
+{
+    size_t index; // Position of the value in the vector
+    int old_value;
+    int new_value;
+};
+
+/**
+ * @brief Histogram kept up to date with a vector that only grows by appends.
+ * It remembers how many values it has counted, so each refresh only counts
+ * the values appended since the last one, in parallel, adds them to the
+ * stored counts and scans them again: the cost is proportional to the values
+ * appended plus the number of bins, not to the size of the vector.
+ *
+ * Values changed in place are applied as batches of updates, each one
+ * taking one from the bin of the old value and adding one to the bin of the
+ * new value. Values at or past offset() have not been counted yet, so their
+ * changes are skipped: the next refresh counts their new value. Only the
+ * counters are updated; the cumulative histogram is
+ * scanned again when it is next read, and only from the lowest bin changed
+ * since, so a few updates do not trigger a whole count or scan.
+ *
+ * If the vector ever shrinks, it is not append-only any more and everything
+ * is counted again.
+ *
+ */
+class IncrementalHistogram
+{
+public:
+    /**
+     * @brief Binds the histogram to a vector and counts its current values.
+     *
+     * @param values vector that grows by appends, which must outlive this
+     * @param spec bins of the histogram
+     */
+    IncrementalHistogram(const std::vector<int> &values, const BinSpec &spec)
+        : values(values), spec(spec)
+    {
+        h.counts.assign(spec.num_bins, 0);
+        h.cumulative.assign(spec.num_bins, 0);
+        dirty_from = size_t(spec.num_bins);
+        refresh();
+    }
+
+    /**
+     * @brief Counts the values appended since the last refresh.
+     *
+     * @return const Histogram& with the regular and cumulative histograms of
+     * the whole vector
+     */
+    const Histogram &refresh()
+    {
+        if (values.size() < counted)
+        {
+            h.counts.assign(spec.num_bins, 0);
+            counted = 0;
+            dirty_from = 0;
+        }
+        if (values.size() > counted)
+        {
+            PROFILE_STAGE(append_timer, "incremental", "append");
+            const Histogram tail = privatized_histogram(values.data() + counted, values.size() - counted, spec);
+            add(tail.counts);
+            counted = values.size();
+            PROFILE_STOP(append_timer);
+        }
+        return histogram();
+    }
+
+    /**
+     * @brief Applies a batch of values changed in place since the last
+     * refresh. The changes are counted in parallel into private differences
+     * per bin, which are then added to the counters. Changes to values not
+     * counted yet, at or past offset(), are skipped.
+     *
+     * @param updates position, old and new value of every change
+     */
+    void update(const std::vector<ValueUpdate> &updates)
+    {
+        PROFILE_STAGE(update_timer, "incremental", "update");
+        const std::vector<int64_t> deltas = oneapi::tbb::parallel_reduce(
+            oneapi::tbb::blocked_range<size_t>(0, updates.size()), std::vector<int64_t>(spec.num_bins),
+            [&](const oneapi::tbb::blocked_range<size_t> &r, std::vector<int64_t> deltas)
+            {
+                TRACE_CHUNK("update", r);
+                for (size_t i = r.begin(); i < r.end(); i++)
+                {
+                    if (updates[i].index >= counted)
+                    {
+                        continue;
+                    }
+                    deltas[spec.bin_of(updates[i].old_value)]--;
+                    deltas[spec.bin_of(updates[i].new_value)]++;
+                }
+                return deltas;
+            },
+            [](std::vector<int64_t> a, const std::vector<int64_t> &b)
+            {
+                for (size_t j = 0; j < a.size(); j++)
+                {
+                    a[j] += b[j];
+                }
+                return a;
+            });
+        add(deltas);
+        PROFILE_STOP(update_timer);
+    }
+
+    /**
+     * @brief Histogram as of the last refresh and update. The cumulative
+     * histogram is scanned from the lowest bin changed since it was last
+     * read, with the rest of the bins left as they were.
+     *
+     * @return const Histogram& with the regular and cumulative histograms
+     */
+    const Histogram &histogram()
+    {
+        if (dirty_from >= h.counts.size())
+        {
+            return h;
+        }
+
+        PROFILE_STAGE(scan_timer, "incremental", "scan");
+        const int64_t base = dirty_from > 0 ? h.cumulative[dirty_from - 1] : 0;
+        oneapi::tbb::parallel_scan(
+            oneapi::tbb::blocked_range<size_t>(dirty_from, h.counts.size()),
+            int64_t(0),
+            [&](oneapi::tbb::blocked_range<size_t> r, int64_t total, bool is_final_scan)
+            {
+                for (size_t j = r.begin(); j < r.end(); j++)
+                {
+                    total += h.counts[j];
+                    if (is_final_scan)
+                    {
+                        h.cumulative[j] = base + total;
+                    }
+                }
+                return total;
+            },
+            [](int64_t x, int64_t y)
+            {
+                return x + y;
+            });
+        dirty_from = h.counts.size();
+        PROFILE_STOP(scan_timer);
+        return h;
+    }
+
+    /**
+     * @brief Number of values counted so far, where the next refresh starts.
+     *
+     * @return size_t with the offset
+     */
+    size_t offset() const
+    {
+        return counted;
+    }
+
+private:
+    // Adds differences to the counters and marks the bins after the first
+    // one changed as needing a scan
+    void add(const std::vector<int64_t> &deltas)
+    {
+        for (size_t j = 0; j < h.counts.size(); j++)
+        {
+            if (deltas[j] != 0)
+            {
+                h.counts[j] += deltas[j];
+                dirty_from = std::min(dirty_from, j);
+            }
+        }
+    }
+
+    const std::vector<int> &values;
+    BinSpec spec;
+    Histogram h;
+    size_t counted = 0;
+    size_t dirty_from; // Lowest bin whose cumulative count is out of date
+};
+
+#endif
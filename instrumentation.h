@@ -0,0 +1,434 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#ifndef PROFILE
+#define PROFILE 1 // Set to 1 to time each stage of the solutions; 0 to compile the timers out
+#endif
+
+#include "memory_accounting.h"
+#include "perf_counters.h"
+#include "tracing.h"
+#include <oneapi/tbb/task_arena.h>
+#include <oneapi/tbb/tick_count.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Timings of one stage of one solution, accumulated across all the
+ * repetitions in which it has been measured, together with the hardware
+ * counters of all the threads and the memory used while the stage was running.
+ *
+ */
+struct StageStats
+{
+    int samples = 0;
+    double total = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+    CounterValues counters;
+    int64_t allocated = 0;    // Heap bytes allocated, summed over all runs
+    int64_t peak = 0;         // Highest heap use of a single run
+    int64_t minor_faults = 0; // Summed over all runs
+    int64_t major_faults = 0; // Summed over all runs
+
+    /**
+     * @brief Adds a new measurement to the statistics.
+     *
+     * @param seconds duration of the stage
+     * @param stage_counters events counted during the stage
+     * @param memory memory used by the stage
+     */
+    void add(double seconds, const CounterValues &stage_counters = CounterValues{},
+             const MemoryUsage &memory = MemoryUsage{})
+    {
+        min = samples == 0 ? seconds : std::min(min, seconds);
+        max = samples == 0 ? seconds : std::max(max, seconds);
+        total += seconds;
+        counters.add(stage_counters);
+        allocated += memory.allocated;
+        peak = std::max(peak, memory.peak);
+        minor_faults += memory.minor_faults;
+        major_faults += memory.major_faults;
+        samples++;
+    }
+
+    /**
+     * @brief Mean value of a hardware counter per run of the stage.
+     *
+     * @param counter event to be averaged
+     * @return double with the mean, 0 if nothing was measured
+     */
+    double mean(PerfCounter counter) const
+    {
+        return samples > 0 ? double(counters.values[counter]) / samples : 0.0;
+    }
+
+    /**
+     * @brief Mean duration of the stage.
+     *
+     * @return double with the mean in seconds, 0 if nothing was measured
+     */
+    double mean() const
+    {
+        return samples > 0 ? total / samples : 0.0;
+    }
+};
+
+/**
+ * @brief Stage statistics identified by the solution and the stage they
+ * belong to, e.g. ("parallel", "map").
+ *
+ */
+struct StageEntry
+{
+    std::string solution;
+    std::string stage;
+    StageStats stats;
+};
+
+/**
+ * @brief Process-wide registry where the stage timers leave their
+ * measurements. Stages are kept in the order they were first recorded, so
+ * reports follow the order of the steps (map, reduce, scan).
+ *
+ * Only one timer records at a time (see ScopedStageTimer), so a mutex is
+ * enough to protect the registry.
+ *
+ */
+class StageProfiler
+{
+public:
+    /**
+     * @brief Returns the global profiler.
+     *
+     * @return StageProfiler& shared by all the solutions
+     */
+    static StageProfiler &instance()
+    {
+        static StageProfiler profiler;
+        return profiler;
+    }
+
+    /**
+     * @brief Adds a measurement to the statistics of a stage.
+     *
+     * @param solution name of the solution the stage belongs to
+     * @param stage name of the stage
+     * @param seconds duration of the stage
+     * @param counters hardware events counted during the stage
+     * @param memory memory used by the stage
+     */
+    void record(const std::string &solution, const std::string &stage, double seconds,
+                const CounterValues &counters = CounterValues{}, const MemoryUsage &memory = MemoryUsage{})
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        find_or_add(solution, stage).stats.add(seconds, counters, memory);
+    }
+
+    /**
+     * @brief Discards all the measurements recorded so far.
+     *
+     */
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+    /**
+     * @brief Returns a copy of the statistics recorded so far.
+     *
+     * @return std::vector<StageEntry> in the order stages were first recorded
+     */
+    std::vector<StageEntry> snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries;
+    }
+
+    /**
+     * @brief Prints a table with the timings of every stage and, next to it,
+     * the memory used and the mean hardware counters per run when they could
+     * be collected.
+     *
+     * @param os stream where the table is printed
+     */
+    void print(std::ostream &os) const
+    {
+        std::vector<StageEntry> copy = snapshot();
+
+        os << std::left << std::setw(14) << "SOLUTION" << std::setw(10) << "STAGE"
+           << std::right << std::setw(6) << "RUNS" << std::setw(14) << "MEAN (s)"
+           << std::setw(14) << "MIN (s)" << std::setw(14) << "MAX (s)" << std::endl;
+        for (const StageEntry &e : copy)
+        {
+            os << std::left << std::setw(14) << e.solution << std::setw(10) << e.stage
+               << std::right << std::setw(6) << e.stats.samples << std::setw(14) << e.stats.mean()
+               << std::setw(14) << e.stats.min << std::setw(14) << e.stats.max << std::endl;
+        }
+        os << std::endl;
+
+        os << std::left << std::setw(14) << "SOLUTION" << std::setw(10) << "STAGE" << std::right
+           << std::setw(14) << "ALLOC (MB)" << std::setw(14) << "PEAK (MB)" << std::setw(14) << "MINOR FLT"
+           << std::setw(14) << "MAJOR FLT" << std::endl;
+        for (const StageEntry &e : copy)
+        {
+            const double runs = std::max(1, e.stats.samples);
+            os << std::left << std::setw(14) << e.solution << std::setw(10) << e.stage << std::right
+               << std::setw(14) << e.stats.allocated / runs / 1e6 << std::setw(14) << e.stats.peak / 1e6
+               << std::setw(14) << e.stats.minor_faults / runs << std::setw(14) << e.stats.major_faults / runs << std::endl;
+        }
+        os << "Peak resident set size of the process: " << MemorySnapshot::now().max_rss / 1e6 << " MB" << std::endl;
+
+        bool any_counters = false;
+        for (const StageEntry &e : copy)
+        {
+            any_counters = any_counters || e.stats.counters.any();
+        }
+        os << std::endl;
+        if (!any_counters)
+        {
+            os << "Hardware counters unavailable" << std::endl;
+            return;
+        }
+
+        os << std::left << std::setw(14) << "SOLUTION" << std::setw(10) << "STAGE" << std::right;
+        for (const char *name : PERF_COUNTER_NAMES)
+        {
+            os << std::setw(15) << name;
+        }
+        os << std::setw(8) << "IPC" << std::endl;
+        for (const StageEntry &e : copy)
+        {
+            os << std::left << std::setw(14) << e.solution << std::setw(10) << e.stage << std::right;
+            for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                if (e.stats.counters.available[i])
+                {
+                    os << std::setw(15) << std::fixed << std::setprecision(0) << e.stats.mean(PerfCounter(i));
+                }
+                else
+                {
+                    os << std::setw(15) << "n/a";
+                }
+            }
+            os.unsetf(std::ios::floatfield);
+            os << std::setprecision(3);
+            if (e.stats.counters.available[PERF_CYCLES] && e.stats.counters.available[PERF_INSTRUCTIONS] &&
+                e.stats.counters.values[PERF_CYCLES] > 0)
+            {
+                os << std::setw(8) << double(e.stats.counters.values[PERF_INSTRUCTIONS]) / e.stats.counters.values[PERF_CYCLES];
+            }
+            else
+            {
+                os << std::setw(8) << "n/a";
+            }
+            os << std::setprecision(6) << std::endl;
+        }
+    }
+
+    /**
+     * @brief Writes the statistics of every stage as CSV.
+     *
+     * @param path file where the CSV is written
+     * @return true if the file could be written, false otherwise
+     */
+    bool export_csv(const std::string &path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+        {
+            return false;
+        }
+
+        file << "solution,stage,samples,total_s,mean_s,min_s,max_s,"
+             << "allocated_bytes,peak_bytes,minor_faults,major_faults";
+        for (const char *name : PERF_COUNTER_NAMES)
+        {
+            file << "," << name;
+        }
+        file << std::endl;
+
+        // Memory and counters are means per run (except the peak, which is the
+        // highest), counters are left empty when they could not be collected
+        for (const StageEntry &e : snapshot())
+        {
+            const int64_t runs = std::max(1, e.stats.samples);
+            file << e.solution << "," << e.stage << "," << e.stats.samples << ","
+                 << e.stats.total << "," << e.stats.mean() << ","
+                 << e.stats.min << "," << e.stats.max << ","
+                 << e.stats.allocated / runs << "," << e.stats.peak << ","
+                 << e.stats.minor_faults / runs << "," << e.stats.major_faults / runs;
+            for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                file << ",";
+                if (e.stats.counters.available[i])
+                {
+                    file << uint64_t(e.stats.mean(PerfCounter(i)));
+                }
+            }
+            file << std::endl;
+        }
+        return bool(file);
+    }
+
+private:
+    StageEntry &find_or_add(const std::string &solution, const std::string &stage)
+    {
+        for (StageEntry &e : entries)
+        {
+            if (e.solution == solution && e.stage == stage)
+            {
+                return e;
+            }
+        }
+        entries.push_back(StageEntry{solution, stage, StageStats{}});
+        return entries.back();
+    }
+
+    mutable std::mutex mutex;
+    std::vector<StageEntry> entries;
+};
+
+/**
+ * @brief RAII timer that records the time elapsed between its construction and
+ * its destruction (or the call to stop) as a sample of a stage, along with the
+ * hardware events counted by all the threads and the memory used in between.
+ * In TRACE mode the stage also appears in the trace, on the thread that ran
+ * it.
+ *
+ * Engines are also called from inside the stages of other solutions and from
+ * TBB tasks, where the process-wide counters they read would mix concurrent
+ * stages up and the syscalls would slow the tasks down. So timers only
+ * record on one thread at a time, never on a TBB worker, and a timer nested
+ * in another one only records if both belong to the same solution, like the
+ * stages of an engine inside its total. Any other timer does nothing: the
+ * engine is just part of the stage that called it.
+ *
+ */
+class ScopedStageTimer
+{
+public:
+    ScopedStageTimer(const char *solution, const char *stage)
+        : solution(solution), stage(stage), outer(current())
+    {
+        if (oneapi::tbb::this_task_arena::current_thread_index() > 0)
+        {
+            recording = false;
+        }
+        else if (outer.depth == 0)
+        {
+            bool expected = false;
+            owner = recording_anywhere().compare_exchange_strong(expected, true, std::memory_order_acquire);
+            recording = owner;
+        }
+        else
+        {
+            recording = outer.recording && std::strcmp(outer.solution, solution) == 0;
+        }
+        current() = OpenTimers{outer.depth + 1, solution, recording};
+
+        if (!recording)
+        {
+            return;
+        }
+        memory.emplace();
+#if PERF_COUNTERS
+        start_counters = PerfCounterMonitor::instance().read_values();
+#endif
+#if TRACE
+        trace_begin = Tracer::instance().now();
+#endif
+        start = oneapi::tbb::tick_count::now();
+    }
+
+    ScopedStageTimer(const ScopedStageTimer &) = delete;
+    ScopedStageTimer &operator=(const ScopedStageTimer &) = delete;
+
+    ~ScopedStageTimer()
+    {
+        stop();
+    }
+
+    /**
+     * @brief Records the elapsed time. Only the first call has any effect.
+     *
+     */
+    void stop()
+    {
+        if (!open)
+        {
+            return;
+        }
+        open = false;
+        current() = outer;
+        if (recording)
+        {
+            double seconds = (oneapi::tbb::tick_count::now() - start).seconds();
+            CounterValues counters;
+#if PERF_COUNTERS
+            counters = PerfCounterMonitor::instance().read_values().since(start_counters);
+#endif
+            StageProfiler::instance().record(solution, stage, seconds, counters, memory->stop());
+#if TRACE
+            Tracer::instance().record(TraceEvent{solution, stage, trace_begin, Tracer::instance().now(), 0, 0, false});
+#endif
+        }
+        if (owner)
+        {
+            recording_anywhere().store(false, std::memory_order_release);
+        }
+    }
+
+private:
+    // Timers of a thread not stopped yet, and the innermost one
+    struct OpenTimers
+    {
+        int depth = 0;
+        const char *solution = "";
+        bool recording = false;
+    };
+
+    static OpenTimers &current()
+    {
+        thread_local OpenTimers open_timers;
+        return open_timers;
+    }
+
+    // Whether the outermost timer of some thread is recording
+    static std::atomic<bool> &recording_anywhere()
+    {
+        static std::atomic<bool> recording{false};
+        return recording;
+    }
+
+    const char *solution;
+    const char *stage;
+    oneapi::tbb::tick_count start;
+    CounterValues start_counters;
+    std::optional<MemoryScope> memory;
+    int64_t trace_begin = 0;
+    OpenTimers outer;
+    bool recording = false;
+    bool owner = false;
+    bool open = true;
+};
+
+// The timers only exist when profiling is enabled, so they cost nothing otherwise
+#if PROFILE
+#define PROFILE_STAGE(timer, solution, stage) ScopedStageTimer timer(solution, stage)
+#define PROFILE_STOP(timer) timer.stop()
+#else
+#define PROFILE_STAGE(timer, solution, stage) ((void)0)
+#define PROFILE_STOP(timer) ((void)0)
+#endif
+
+#endif
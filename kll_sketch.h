@@ -0,0 +1,351 @@
+#ifndef KLL_SKETCH_H
+#define KLL_SKETCH_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include "sparse_histogram.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Size of the largest level of the sketch. The rank error is roughly
+ * 1.7 / k, so 200 gives quantiles within about 1% of the values.
+ *
+ */
+const int KLL_DEFAULT_K = 200;
+
+/**
+ * @brief Smallest capacity of any level, so every compaction keeps something
+ *
+ */
+const int KLL_MIN_CAPACITY = 8;
+
+/**
+ * @brief Mergeable quantile sketch (KLL: Karnin, Lang and Liberty). Values
+ * are kept in levels: an item of level h stands for 2^h values. When the
+ * sketch holds more items than its capacity, the lowest full level is
+ * compacted: it is sorted and every other item, starting at a random one,
+ * moves up a level while the rest are dropped. Capacities shrink by 2/3 per
+ * level going down from the top, so the sketch stays O(k) items for any
+ * number of values, and two sketches merge by concatenating their levels.
+ *
+ */
+class KllSketch
+{
+public:
+    explicit KllSketch(int k = KLL_DEFAULT_K, uint64_t seed = 0)
+        : k(k), levels(1), random(hash_key(seed + 1))
+    {
+        update_limit();
+    }
+
+    /**
+     * @brief Empty sketch with the same k and another seed, so that sketches
+     * built in parallel do not compact with the same coin flips. The state of
+     * this sketch is only read, so it may be forked while it is updated.
+     *
+     * @param seed seed of the new sketch, different for every fork
+     * @return KllSketch with no values
+     */
+    KllSketch fork(uint64_t seed) const
+    {
+        return KllSketch(k, seed);
+    }
+
+    /**
+     * @brief Adds a value to the sketch.
+     *
+     * @param value value to be added
+     */
+    void update(double value)
+    {
+        levels[0].push_back(value);
+        n++;
+        if (++retained > limit)
+        {
+            compress();
+        }
+    }
+
+    /**
+     * @brief Adds all the values of another sketch to this one.
+     *
+     * @param other sketch to be merged
+     */
+    void merge(const KllSketch &other)
+    {
+        if (other.levels.size() > levels.size())
+        {
+            levels.resize(other.levels.size());
+            update_limit();
+        }
+        for (size_t h = 0; h < other.levels.size(); h++)
+        {
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        }
+        n += other.n;
+        retained += other.retained;
+        compress();
+    }
+
+    /**
+     * @brief Number of values added to the sketch.
+     *
+     * @return int64_t with the number of values
+     */
+    int64_t count() const
+    {
+        return n;
+    }
+
+    /**
+     * @brief Number of items kept by the sketch, whatever the values added.
+     *
+     * @return size_t with the number of items
+     */
+    size_t size() const
+    {
+        return retained;
+    }
+
+    /**
+     * @brief Estimated values below which the fractions ps of the values
+     * fall. The items are sorted once for the whole batch.
+     *
+     * @param ps fractions of the values, between 0 and 1
+     * @return std::vector<double> with a value per fraction, in the same order
+     */
+    std::vector<double> quantiles(const std::vector<double> &ps) const
+    {
+        std::vector<std::pair<double, int64_t>> items = weighted_items();
+        std::vector<double> values(ps.size(), 0.0);
+        for (size_t q = 0; q < ps.size() && !items.empty(); q++)
+        {
+            const double target = std::min(1.0, std::max(0.0, ps[q])) * n;
+            int64_t weight = 0;
+            size_t i = 0;
+            while (i + 1 < items.size() && weight + items[i].second < target)
+            {
+                weight += items[i++].second;
+            }
+            values[q] = items[i].first;
+        }
+        return values;
+    }
+
+    /**
+     * @brief Estimated value below which a fraction p of the values fall.
+     *
+     * @param p fraction of the values, between 0 and 1
+     * @return double with the value, 0 for an empty sketch
+     */
+    double quantile(double p) const
+    {
+        return quantiles({p})[0];
+    }
+
+    /**
+     * @brief Estimated number of values not larger than a given one.
+     *
+     * @param value value whose rank is wanted
+     * @return int64_t with the rank
+     */
+    int64_t rank(double value) const
+    {
+        int64_t weight = 0;
+        for (size_t h = 0; h < levels.size(); h++)
+        {
+            for (double item : levels[h])
+            {
+                weight += item <= value ? int64_t(1) << h : 0;
+            }
+        }
+        return weight;
+    }
+
+private:
+    size_t capacity(size_t h) const
+    {
+        const double depth = double(levels.size() - 1 - h);
+        return std::max<size_t>(KLL_MIN_CAPACITY, size_t(std::ceil(k * std::pow(2.0 / 3.0, depth))));
+    }
+
+    void update_limit()
+    {
+        limit = 0;
+        for (size_t h = 0; h < levels.size(); h++)
+        {
+            limit += capacity(h);
+        }
+    }
+
+    uint64_t next_random()
+    {
+        random = hash_key(random + 0x9e3779b97f4a7c15ULL);
+        return random;
+    }
+
+    /**
+     * @brief Compacts the lowest full level until the sketch is within its
+     * capacity again, adding a level on top when the top one fills up.
+     *
+     */
+    void compress()
+    {
+        while (retained > limit)
+        {
+            size_t h = 0;
+            while (levels[h].size() < capacity(h))
+            {
+                h++;
+            }
+            if (h + 1 == levels.size())
+            {
+                levels.emplace_back();
+                update_limit();
+            }
+
+            // An odd item out stays behind, so the weight is kept exactly
+            std::vector<double> &level = levels[h];
+            std::sort(level.begin(), level.end());
+            double left_over = 0.0;
+            const bool odd = level.size() % 2 == 1;
+            if (odd)
+            {
+                left_over = level.back();
+                level.pop_back();
+            }
+            const size_t offset = next_random() & 1;
+            for (size_t i = offset; i < level.size(); i += 2)
+            {
+                levels[h + 1].push_back(level[i]);
+            }
+            retained -= level.size() / 2;
+            level.clear();
+            if (odd)
+            {
+                level.push_back(left_over);
+            }
+        }
+    }
+
+    std::vector<std::pair<double, int64_t>> weighted_items() const
+    {
+        std::vector<std::pair<double, int64_t>> items;
+        items.reserve(retained);
+        for (size_t h = 0; h < levels.size(); h++)
+        {
+            for (double item : levels[h])
+            {
+                items.emplace_back(item, int64_t(1) << h);
+            }
+        }
+        std::sort(items.begin(), items.end());
+        return items;
+    }
+
+    int k;
+    std::vector<std::vector<double>> levels;
+    uint64_t random;
+    int64_t n = 0;
+    size_t retained = 0;
+    size_t limit = 0;
+};
+
+/**
+ * @brief Cumulative histogram and quantile sketch of the same values.
+ *
+ */
+struct SketchedHistogram
+{
+    Histogram histogram;
+    KllSketch sketch;
+};
+
+/**
+ * @brief Body of parallel_reduce that counts a range of values into a private
+ * histogram, as PrivateCounts, and adds them to a private sketch in the same
+ * loop. Sketches are merged with the histograms when the tasks join. Split
+ * bodies seed their sketches from a counter shared by the whole reduction,
+ * since TBB may split a body while it is still counting.
+ *
+ */
+class SketchedCounts
+{
+public:
+    SketchedCounts(const int *values, const BinSpec &spec, int k)
+        : counts(spec.num_bins), sketch(k), values(values), spec(spec),
+          forks(std::make_shared<std::atomic<uint64_t>>(0)) {}
+
+    SketchedCounts(SketchedCounts &other, oneapi::tbb::split)
+        : counts(other.spec.num_bins), sketch(other.sketch.fork(next_seed(other))), values(other.values),
+          spec(other.spec), forks(other.forks) {}
+
+    void operator()(const oneapi::tbb::blocked_range<size_t> &r)
+    {
+        TRACE_CHUNK("count", r);
+        for (size_t i = r.begin(); i < r.end(); i++)
+        {
+            counts[spec.bin_of(values[i])]++;
+            sketch.update(values[i]);
+        }
+    }
+
+    void join(const SketchedCounts &other)
+    {
+        for (size_t j = 0; j < counts.size(); j++)
+        {
+            counts[j] += other.counts[j];
+        }
+        sketch.merge(other.sketch);
+    }
+
+    std::vector<int64_t> counts;
+    KllSketch sketch;
+
+private:
+    static uint64_t next_seed(const SketchedCounts &other)
+    {
+        return other.forks->fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    const int *values;
+    BinSpec spec;
+    std::shared_ptr<std::atomic<uint64_t>> forks; // Sketches forked so far
+};
+
+/**
+ * @brief Privatized engine that also builds a quantile sketch in the same
+ * pass over the values, so a single scan gives both the cumulative histogram
+ * and percentiles that keep their resolution in the tail, where fixed bins
+ * lose it.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param k size of the largest level of the sketch
+ * @return SketchedHistogram with the histograms and the sketch
+ */
+inline SketchedHistogram sketched_histogram(const int *values, size_t n, const BinSpec &spec, int k = KLL_DEFAULT_K)
+{
+    PROFILE_STAGE(count_timer, "sketched", "count");
+    SketchedCounts body(values, spec, k);
+    oneapi::tbb::parallel_reduce(oneapi::tbb::blocked_range<size_t>(0, n), body);
+    SketchedHistogram result{Histogram{}, std::move(body.sketch)};
+    result.histogram.counts = std::move(body.counts);
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(scan_timer, "sketched", "scan");
+    result.histogram.cumulative = cumulative_sum(result.histogram.counts);
+    PROFILE_STOP(scan_timer);
+    return result;
+}
+
+#endif
@@ -9,8 +9,51 @@
 #include <cmath>
 #include <vector>
 #include <random>
+#include <iomanip>
+#include <string>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 
-#define DEBUG 1 // Set to 1 to see the results of each step; 0 to deactivate
+#define DEBUG 1             // Set to 1 to see the results of each step; 0 to deactivate
+#define PROFILE 1           // Set to 1 to time each stage and run the benchmark; 0 to deactivate
+#define PERF_COUNTERS 1     // Set to 1 to count hardware events per stage (Linux only); 0 to deactivate
+#define TRACE 0             // Set to 1 to export every TBB chunk of the benchmark as a Chrome trace; 0 to deactivate
+#define UTILIZATION 1       // Set to 1 to report how the threads are used in a parallel run; 0 to deactivate
+#define MEMORY_ACCOUNTING 0 // Set to 1 to count the heap allocated by each stage (compile memory_accounting.cpp too); 0 to deactivate
+#define ROOFLINE 0          // Set to 1 to compare the benchmark with the memory bandwidth of the machine; 0 to deactivate
+#define BIN_SCALING 0       // Set to 1 to benchmark the engines from 4 to 10^8 bins (needs a few GB); 0 to deactivate
+#define SPARSE 0            // Set to 1 to benchmark the sparse histograms of 64-bit keys; 0 to deactivate
+#define SHARED_MEMORY 0     // Set to 1 to aggregate shards counted by several processes in shared memory; 0 to deactivate
+#define CLUSTER 0           // Set to 1 to scatter shards to worker processes over sockets and gather them; 0 to deactivate
+#define DAEMON 0            // Set to 1 to query a resident histogram daemon over a Unix socket; 0 to deactivate
+#define INCREMENTAL 0       // Set to 1 to benchmark keeping a histogram up to date with appends; 0 to deactivate
+#define BATCH 0             // Set to 1 to benchmark the histograms of many small arrays in one call; 0 to deactivate
+#define SEGMENTED 0         // Set to 1 to benchmark the histograms of skewed segments of one buffer; 0 to deactivate
+#define ASYNC 0             // Set to 1 to compute a histogram in the background and cancel another; 0 to deactivate
+
+#include "approximate.h"
+#include "async_histogram.h"
+#include "atomic_engine.h"
+#include "batch_histograms.h"
+#include "cluster.h"
+#include "daemon.h"
+#include "engines.h"
+#include "equi_depth.h"
+#include "histogram_awaitable.h"
+#include "incremental.h"
+#include "instrumentation.h"
+#include "kll_sketch.h"
+#include "memory_estimate.h"
+#include "partition_engine.h"
+#include "planner.h"
+#include "processes.h"
+#include "quantiles.h"
+#include "roofline.h"
+#include "segmented.h"
+#include "serialization.h"
+#include "shared_memory.h"
+#include "sparse_histogram.h"
 
 /**
  * @brief Number of bins
@@ -19,17 +62,74 @@
 const int NUM_BINS = 4;
 
 /**
- * @brief Generates a vector with random integers.
+ * @brief Largest vector whose intermediate steps are printed in DEBUG mode
+ *
+ */
+const int DEBUG_PRINT_LIMIT = 100;
+
+/**
+ * @brief File where the chunk trace of the benchmark is written in TRACE mode
+ *
+ */
+const std::string TRACE_FILE = "trace.json";
+
+/**
+ * @brief Percentile queries answered in each batch of the benchmark
+ *
+ */
+const int QUANTILE_QUERIES = 100000;
+
+/**
+ * @brief Widest confidence half-interval, as a fraction of the values, and
+ * seconds allowed to the approximate histogram of the benchmark
+ *
+ */
+const double APPROXIMATE_TARGET_ERROR = 0.001;
+const double APPROXIMATE_TIME_BUDGET = 0.05;
+
+/**
+ * @brief Shards the benchmark input is split into to serialize and merge
+ * their partial histograms
+ *
+ */
+const int SHARDS = 16;
+
+/**
+ * @brief First argument of the processes spawned by the shared-memory
+ * benchmark, followed by the segment, the region, the shard size and the
+ * maximum value
+ *
+ */
+const std::string SHARED_MEMORY_WORKER = "--shared-memory-worker";
+
+/**
+ * @brief First argument of the processes spawned by the cluster benchmark,
+ * followed by the address of the coordinator
+ *
+ */
+const std::string CLUSTER_WORKER = "--cluster-worker";
+
+/**
+ * @brief First argument that runs the program as a histogram daemon, followed
+ * by the address to listen on
+ *
+ */
+const std::string DAEMON_MODE = "--daemon";
+
+/**
+ * @brief Generates a vector with random integers from a given seed, so other
+ * processes can generate the same values.
  *
  * @param size number of elements of the vector
  * @param max maximum integer value allowed
+ * @param seed seed of the generator
  * @return std::vector<int> containing the random integers
  */
-std::vector<int> random_vector(int size, int max)
+std::vector<int> seeded_vector(int size, int max, unsigned seed)
 {
 
     // Prepare generator and random distribution
-    std::mt19937 gen(std::random_device{}());
+    std::mt19937 gen(seed);
     std::exponential_distribution<> dist(0.05);
 
     std::vector<int> v(size);
@@ -41,6 +141,18 @@ std::vector<int> random_vector(int size, int max)
     return v;
 }
 
+/**
+ * @brief Generates a vector with random integers.
+ *
+ * @param size number of elements of the vector
+ * @param max maximum integer value allowed
+ * @return std::vector<int> containing the random integers
+ */
+std::vector<int> random_vector(int size, int max)
+{
+    return seeded_vector(size, max, std::random_device{}());
+}
+
 /**
  * @brief Classifies the values of a numeric array into a cumulative histogram.
  * Parallelizes the different steps using oneapi tbb. These steps are:
@@ -61,17 +173,20 @@ std::vector<int> random_vector(int size, int max)
  *
  * @param values array of integers with the values to be classified
  * @param bin_span integer with the range of a bin
+ * @return std::array<int, NUM_BINS> with the cumulative histogram
  */
-void parallel_solution(std::vector<int> &values, int bin_span)
+std::array<int, NUM_BINS> parallel_solution(std::vector<int> &values, int bin_span)
 {
     const int N = values.size();
 
     // Map each value to its corresponding bin
+    PROFILE_STAGE(map_timer, "parallel", "map");
     std::vector<std::array<int, NUM_BINS>> mapped_values(N);
     oneapi::tbb::parallel_for(
         oneapi::tbb::blocked_range<int>(0, N),
         [&](tbb::blocked_range<int> r)
         {
+            TRACE_CHUNK("map", r);
             for (int i = r.begin(); i < r.end(); i++)
             {
                 int val = values[i] > 0 ? values[i] - 1 : values[i]; // 0 belongs in the first bin
@@ -81,36 +196,42 @@ void parallel_solution(std::vector<int> &values, int bin_span)
                 mapped_values[i] = arr;
             }
         });
+    PROFILE_STOP(map_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << "STEP 1: MAP" << std::endl;
-    for (int i = 0; i < mapped_values.size(); i++)
+    if (N <= DEBUG_PRINT_LIMIT)
     {
-        std::cout << "{ ";
-        for (int x : mapped_values[i])
+        std::cout << "STEP 1: MAP" << std::endl;
+        for (int i = 0; i < mapped_values.size(); i++)
         {
-            std::cout << x << " ";
-        }
+            std::cout << "{ ";
+            for (int x : mapped_values[i])
+            {
+                std::cout << x << " ";
+            }
 
-        if (i == mapped_values.size() - 1)
-        {
-            std::cout << "}" << std::endl;
-        }
-        else
-        {
-            std::cout << "}, ";
+            if (i == mapped_values.size() - 1)
+            {
+                std::cout << "}" << std::endl;
+            }
+            else
+            {
+                std::cout << "}, ";
+            }
         }
     }
 #endif
 
     // Sum up all values for each bin (reduce)
+    PROFILE_STAGE(reduce_timer, "parallel", "reduce");
     std::array<int, NUM_BINS> bins{};
     bins = oneapi::tbb::parallel_reduce(
         oneapi::tbb::blocked_range<int>(0, N),
         std::array<int, NUM_BINS>{},
         [&](oneapi::tbb::blocked_range<int> r, std::array<int, NUM_BINS> total)
         {
+            TRACE_CHUNK("reduce", r);
             for (int i = r.begin(); i < r.end(); i++)
             {
                 for (int j = 0; j < NUM_BINS; j++)
@@ -129,25 +250,31 @@ void parallel_solution(std::vector<int> &values, int bin_span)
             }
             return res;
         });
+    PROFILE_STOP(reduce_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << std::endl
-              << "STEP 2: REDUCE" << std::endl;
-    for (int i : bins)
+    if (N <= DEBUG_PRINT_LIMIT)
     {
-        std::cout << i << " ";
+        std::cout << std::endl
+                  << "STEP 2: REDUCE" << std::endl;
+        for (int i : bins)
+        {
+            std::cout << i << " ";
+        }
+        std::cout << std::endl;
     }
-    std::cout << std::endl;
 #endif
 
     // Scan through the bins to build the cumulative histogram
+    PROFILE_STAGE(scan_timer, "parallel", "scan");
     std::array<int, NUM_BINS> cumulative_histogram{};
     oneapi::tbb::parallel_scan(
         oneapi::tbb::blocked_range<int>(0, NUM_BINS),
         0,
         [&](oneapi::tbb::blocked_range<int> r, int total, bool is_final_scan)
         {
+            TRACE_CHUNK("scan", r);
             for (int i = r.begin(); i < r.end(); i++)
             {
                 total += bins[i];
@@ -162,19 +289,18 @@ void parallel_solution(std::vector<int> &values, int bin_span)
         {
             return x + y;
         });
+    PROFILE_STOP(scan_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << std::endl
-              << "STEP 3: SCAN" << std::endl;
-#endif
-
-    for (int i = 0; i < NUM_BINS; i++)
+    if (N <= DEBUG_PRINT_LIMIT)
     {
-        std::cout << cumulative_histogram[i] << " ";
+        std::cout << std::endl
+                  << "STEP 3: SCAN" << std::endl;
     }
-    std::cout << std::endl
-              << std::endl;
+#endif
+
+    return cumulative_histogram;
 }
 
 /**
@@ -184,12 +310,14 @@ void parallel_solution(std::vector<int> &values, int bin_span)
  * @see parallel_solution
  * @param values array of integers with the values to be classified
  * @param bin_span integer with the range of a bin
+ * @return std::array<int, NUM_BINS> with the cumulative histogram
  */
-void sequential_solution(std::vector<int> values, int bin_span)
+std::array<int, NUM_BINS> sequential_solution(std::vector<int> values, int bin_span)
 {
     const int N = values.size();
 
     // Map each value to its corresponding bin
+    PROFILE_STAGE(map_timer, "sequential", "map");
     std::vector<std::array<int, NUM_BINS>> mapped_values(N);
     for (int i = 0; i < N; i++)
     {
@@ -199,30 +327,35 @@ void sequential_solution(std::vector<int> values, int bin_span)
         arr[idx]++;
         mapped_values[i] = arr;
     }
+    PROFILE_STOP(map_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << "STEP 1: MAP" << std::endl;
-    for (int i = 0; i < mapped_values.size(); i++)
+    if (N <= DEBUG_PRINT_LIMIT)
     {
-        std::cout << "{ ";
-        for (int x : mapped_values[i])
+        std::cout << "STEP 1: MAP" << std::endl;
+        for (int i = 0; i < mapped_values.size(); i++)
         {
-            std::cout << x << " ";
-        }
+            std::cout << "{ ";
+            for (int x : mapped_values[i])
+            {
+                std::cout << x << " ";
+            }
 
-        if (i == mapped_values.size() - 1)
-        {
-            std::cout << "}" << std::endl;
-        }
-        else
-        {
-            std::cout << "}, ";
+            if (i == mapped_values.size() - 1)
+            {
+                std::cout << "}" << std::endl;
+            }
+            else
+            {
+                std::cout << "}, ";
+            }
         }
     }
 #endif
 
     // Sum up all values for each bin (reduce)
+    PROFILE_STAGE(reduce_timer, "sequential", "reduce");
     std::array<int, NUM_BINS> bins{};
     for (int i = 0; i < mapped_values.size(); i++)
     {
@@ -231,19 +364,24 @@ void sequential_solution(std::vector<int> values, int bin_span)
             bins[j] += mapped_values[i][j];
         }
     }
+    PROFILE_STOP(reduce_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << std::endl
-              << "STEP 2: REDUCE" << std::endl;
-    for (int i : bins)
+    if (N <= DEBUG_PRINT_LIMIT)
     {
-        std::cout << i << " ";
+        std::cout << std::endl
+                  << "STEP 2: REDUCE" << std::endl;
+        for (int i : bins)
+        {
+            std::cout << i << " ";
+        }
+        std::cout << std::endl;
     }
-    std::cout << std::endl;
 #endif
 
     // Scan through the bins to build the cumulative histogram
+    PROFILE_STAGE(scan_timer, "sequential", "scan");
     std::array<int, NUM_BINS> cumulative_histogram{};
     int total = 0;
     for (int i = 0; i < NUM_BINS; i++)
@@ -251,13 +389,27 @@ void sequential_solution(std::vector<int> values, int bin_span)
         total += bins[i];
         cumulative_histogram[i] = total;
     }
+    PROFILE_STOP(scan_timer);
 
 #if DEBUG
     // Print the results
-    std::cout << std::endl
-              << "STEP 3: SCAN" << std::endl;
+    if (N <= DEBUG_PRINT_LIMIT)
+    {
+        std::cout << std::endl
+                  << "STEP 3: SCAN" << std::endl;
+    }
 #endif
 
+    return cumulative_histogram;
+}
+
+/**
+ * @brief Prints the bins of a cumulative histogram in a single line.
+ *
+ * @param cumulative_histogram histogram to be printed
+ */
+void print_histogram(const std::array<int, NUM_BINS> &cumulative_histogram)
+{
     for (int i = 0; i < NUM_BINS; i++)
     {
         std::cout << cumulative_histogram[i] << " ";
@@ -267,76 +419,1163 @@ void sequential_solution(std::vector<int> values, int bin_span)
 }
 
 /**
- * @brief Main function. Calls both parallel and sequential solutions for the
- * same array of values and computes the time they take to finish.
+ * @brief Runs both solutions, and the other engines, several times over a
+ * larger vector and prints the time spent on each stage, aggregated across all
+ * the repetitions. The same statistics are exported as CSV so they can be
+ * compared between runs.
  *
- * @return int exit status
+ * @param size number of elements of the vector
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ * @param repetitions number of times each solution is run
+ * @param csv_path file where the statistics are exported
  */
-int main()
+void run_benchmark(int size, int max, int bin_span, int repetitions, const std::string &csv_path)
 {
+    std::vector<int> values = random_vector(size, max);
 
-    const int N = 10;
-    const int MAX_VALUE = 120;
-    std::vector<int> values = random_vector(N, MAX_VALUE);
-
-    // Sort vector just in case
-    std::sort(values.begin(), values.end());
+    // Forget the stages timed so far, so only the benchmark runs are reported
+    StageProfiler &profiler = StageProfiler::instance();
+    profiler.reset();
+#if TRACE
+    Tracer::instance().clear();
+#endif
 
-#if DEBUG
-    std::cout << std::endl
-              << "Vector: [";
-    for (int i = 0; i < values.size(); i++)
+    for (int rep = 0; rep < repetitions; rep++)
     {
-        std::cout << values[i];
+        ScopedStageTimer parallel_timer("parallel", "total");
+        std::array<int, NUM_BINS> parallel_result = parallel_solution(values, bin_span);
+        parallel_timer.stop();
 
-        if (i < values.size() - 1)
+        ScopedStageTimer sequential_timer("sequential", "total");
+        std::array<int, NUM_BINS> sequential_result = sequential_solution(values, bin_span);
+        sequential_timer.stop();
+
+        assert(parallel_result == sequential_result);
+
+        for (Engine engine : {ENGINE_PRIVATIZED, ENGINE_STREAMING, ENGINE_ATOMIC, ENGINE_PARTITION})
         {
-            std::cout << ", ";
+            ScopedStageTimer engine_timer(ENGINE_NAMES[engine], "total");
+            Histogram result = run_engine(engine, values, BinSpec{bin_span, NUM_BINS});
+            engine_timer.stop();
+
+            assert(std::equal(parallel_result.begin(), parallel_result.end(), result.cumulative.begin()));
         }
     }
-    std::cout << "]" << std::endl
-              << std::endl;
-#endif
 
-    // Get the biggest element and compute the bin size from it
-    const int BIN_SPAN = std::ceil(MAX_VALUE / NUM_BINS);
+    // Percentile queries over the histogram of the whole input, and over a
+    // sketch built in the same pass
+    const BinSpec spec{bin_span, NUM_BINS};
+    for (int rep = 0; rep < repetitions; rep++)
+    {
+        ScopedStageTimer sketched_timer("sketched", "total");
+        SketchedHistogram result = sketched_histogram(values.data(), values.size(), spec);
+        sketched_timer.stop();
+        assert(result.sketch.count() == size);
+    }
+    const SketchedHistogram sketched = sketched_histogram(values.data(), values.size(), spec);
+    const Histogram &histogram = sketched.histogram;
+
+    // Partial histograms of shards, serialized as other processes would send them
+    std::vector<std::vector<uint8_t>> buffers(SHARDS);
+    size_t serialized_bytes = 0;
+    for (int shard = 0; shard < SHARDS; shard++)
+    {
+        const size_t begin = size_t(shard) * size / SHARDS;
+        const size_t end = size_t(shard + 1) * size / SHARDS;
+        PROFILE_STAGE(encode_timer, "serialized", "encode");
+        buffers[shard] = serialize_histogram(partial_histogram(values.data() + begin, end - begin, spec));
+        PROFILE_STOP(encode_timer);
+        serialized_bytes += buffers[shard].size();
+    }
+    PartialHistogram merged;
+    const bool merged_ok = merge_serialized(buffers, merged);
+    assert(merged_ok && to_histogram(merged).cumulative == histogram.cumulative);
+    std::vector<double> ps(QUANTILE_QUERIES);
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (double &p : ps)
+    {
+        p = unit(gen);
+    }
+    for (int rep = 0; rep < repetitions; rep++)
+    {
+        ScopedStageTimer quantile_timer("quantiles", "batch");
+        std::vector<double> answers = quantiles(histogram, spec, ps);
+        quantile_timer.stop();
+        assert(answers.size() == ps.size());
+    }
+    const EquiDepthBins equi_depth = equi_depth_bins(values, NUM_BINS);
+    const ApproximateHistogram approximate = progressive_histogram(values.data(), values.size(), spec,
+                                                                   APPROXIMATE_TARGET_ERROR, APPROXIMATE_TIME_BUDGET);
 
+    std::cout << "Elements: " << size << ", repetitions: " << repetitions << std::endl
+              << std::endl;
+    std::cout << "Estimated memory:";
+    for (int e = 0; e < NUM_ENGINES; e++)
+    {
+        std::cout << " " << ENGINE_NAMES[e] << " " << estimate_memory(Engine(e), size, NUM_BINS).total() / 1e6 << " MB";
+    }
     std::cout << std::endl
-              << "NUMBER OF BINS: " << NUM_BINS << std::endl
               << std::endl;
-
-    // Distribute the bins evenly
-    auto bin_range_values = std::vector<int>(NUM_BINS);
-    for (int i = 0; i < NUM_BINS; i++)
+    profiler.print(std::cout);
+    std::vector<int> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    const std::vector<double> from_bins = quantiles(histogram, spec, COMMON_QUANTILES);
+    const std::vector<double> from_sketch = sketched.sketch.quantiles(COMMON_QUANTILES);
+    std::cout << std::endl
+              << "Percentiles (bins / sketch of " << sketched.sketch.size() << " items / exact):";
+    for (size_t i = 0; i < COMMON_QUANTILES.size(); i++)
     {
-        bin_range_values[i] = MAX_VALUE - (NUM_BINS - 1 - i) * BIN_SPAN;
-
-        int previous = 0;
-        if (i > 0)
+        std::cout << " p" << COMMON_QUANTILES[i] * 100 << " " << from_bins[i] << " / " << from_sketch[i] << " / "
+                  << sorted[std::min(sorted.size() - 1, size_t(COMMON_QUANTILES[i] * sorted.size()))];
+    }
+    for (const StageEntry &entry : profiler.snapshot())
+    {
+        if (entry.solution == "quantiles")
         {
-            previous = bin_range_values[i - 1] + 1;
+            std::cout << std::endl
+                      << "Percentile queries per second: " << QUANTILE_QUERIES / entry.stats.mean();
         }
-        std::cout << "BIN " << i + 1 << ": " << previous << " - " << bin_range_values[i] << std::endl
-                  << std::endl;
     }
-
     std::cout << std::endl
-              << "=== PARALLEL SOLUTION =======================================" << std::endl
               << std::endl;
-    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
-    parallel_solution(values, BIN_SPAN);
-    std::cout << "\nTime: " << (oneapi::tbb::tick_count::now() - t0).seconds() << "seconds" << std::endl
+
+    // Equal-width bins are unbalanced on exponential values; equal-depth ones are not
+    std::cout << "Equal-width bins:";
+    for (size_t i = 0; i < histogram.counts.size(); i++)
+    {
+        std::cout << " [" << (i == 0 ? 0 : i * bin_span + 1) << ", " << (i + 1) * bin_span << "] " << histogram.counts[i];
+    }
+    std::cout << std::endl
+              << "Equal-depth bins:";
+    for (size_t i = 0; i < equi_depth.counts.size(); i++)
+    {
+        std::cout << " [" << equi_depth.edges[i] << ", " << equi_depth.edges[i + 1] - 1 << "] " << equi_depth.counts[i];
+    }
+    std::cout << std::endl
               << std::endl;
-    std::cout << "=============================================================" << std::endl
+
+    std::cout << "Merged " << SHARDS << " serialized shards of " << serialized_bytes / double(SHARDS)
+              << " bytes on average" << (merged_ok ? "" : " (invalid)") << ": min " << merged.min << ", max " << merged.max
+              << ", mean " << double(merged.sum) / merged.total() << std::endl
               << std::endl;
 
+    std::cout << "Approximate histogram from " << approximate.sample_size << " sampled values in "
+              << approximate.seconds << " s, error " << approximate.error << ":" << std::endl;
+    for (size_t i = 0; i < histogram.counts.size(); i++)
+    {
+        std::cout << "  bin " << i + 1 << ": " << approximate.estimate.counts[i] << " in [" << std::llround(approximate.lower[i])
+                  << ", " << std::llround(approximate.upper[i]) << "], exact " << histogram.counts[i] << std::endl;
+    }
+    std::cout << std::endl;
+    if (profiler.export_csv(csv_path))
+    {
+        std::cout << std::endl
+                  << "Stage timings exported to " << csv_path << std::endl;
+    }
+    else
+    {
+        std::cerr << "Could not write " << csv_path << std::endl;
+    }
+
+#if ROOFLINE
+    // Streaming through the same input bounds how fast any solution can go
     std::cout << std::endl
-              << "=== SEQUENTIAL SOLUTION =====================================" << std::endl
-              << std::endl;
-    oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
-    sequential_solution(values, BIN_SPAN);
-    std::cout << "\nTime: " << (oneapi::tbb::tick_count::now() - t1).seconds() << "seconds" << std::endl
+              << "Memory bandwidth roofline:" << std::endl
               << std::endl;
-    std::cout << "=============================================================" << std::endl
+    print_roofline(measure_roofline(values, repetitions), profiler.snapshot(), double(size) * sizeof(int), std::cout);
+#endif
+
+#if UTILIZATION
+    // One more parallel run, on its own, to see how it uses the threads
+    UtilizationMonitor &monitor = UtilizationMonitor::instance();
+    monitor.begin_run();
+    parallel_solution(values, bin_span);
+    monitor.end_run();
+    std::cout << std::endl
+              << "Thread utilization of the parallel solution:" << std::endl
               << std::endl;
+    monitor.print(std::cout);
+#endif
+
+#if TRACE
+    if (Tracer::instance().write_chrome_json(TRACE_FILE))
+    {
+        std::cout << "Chunk trace exported to " << TRACE_FILE << std::endl;
+    }
+    else
+    {
+        std::cerr << "Could not write " << TRACE_FILE << std::endl;
+    }
+#endif
+}
+
+/**
+ * @brief Compares private copies of the histogram against a shared one with
+ * atomic counters, and against partitioning before counting, as the number of
+ * bins grows from 4 to 10^8. Each bin count is run with the values spread
+ * uniformly over the bins and with all of them in the first bin, the worst
+ * case for shared counters. Engines are skipped when they do not fit in the
+ * memory budget.
+ *
+ * @param size number of elements of the vector
+ * @param repetitions number of times each engine is run, the best is kept
+ * @param memory_budget bytes the engines may use
+ */
+void run_bin_scaling_benchmark(int size, int repetitions, int64_t memory_budget)
+{
+    const std::vector<int> BIN_COUNTS = {4, 64, 1024, 1 << 14, 1 << 20, 1 << 24, 100000000};
+    const int threads = oneapi::tbb::info::default_concurrency();
+    std::mt19937 gen(std::random_device{}());
+
+    std::cout << std::left << std::setw(12) << "BINS" << std::setw(10) << "VALUES" << std::setw(12) << "ENGINE"
+              << std::right << std::setw(8) << "SHARDS" << std::setw(14) << "TIME (s)" << std::setw(16) << "MVALUES/s" << std::endl;
+    for (int bins : BIN_COUNTS)
+    {
+        const BinSpec spec{1, bins};
+        std::vector<int> values(size);
+        for (const char *distribution : {"uniform", "one-bin"})
+        {
+            if (std::string(distribution) == "uniform")
+            {
+                std::uniform_int_distribution<int> dist(0, bins);
+                for (int &v : values)
+                {
+                    v = dist(gen);
+                }
+            }
+            else
+            {
+                std::fill(values.begin(), values.end(), 0);
+            }
+
+            // Private copies, one shard, as many shards as probed, and partitioning
+            std::vector<std::pair<Engine, int>> configurations = {{ENGINE_PRIVATIZED, 0}, {ENGINE_ATOMIC, 1}};
+            const int probed = choose_shards(values.data(), values.size(), spec, threads, memory_budget);
+            if (probed > 1)
+            {
+                configurations.emplace_back(ENGINE_ATOMIC, probed);
+            }
+            configurations.emplace_back(ENGINE_PARTITION, 0);
+
+            for (const std::pair<Engine, int> &configuration : configurations)
+            {
+                const Engine engine = configuration.first;
+                const int shards = configuration.second;
+                std::cout << std::left << std::setw(12) << bins << std::setw(10) << distribution << std::setw(12)
+                          << ENGINE_NAMES[engine] << std::right << std::setw(8)
+                          << (engine == ENGINE_ATOMIC ? std::to_string(shards) : "-");
+                if (engine != ENGINE_ATOMIC && estimate_memory(engine, size, bins).working_bytes > memory_budget)
+                {
+                    std::cout << std::setw(14) << "over budget" << std::endl;
+                    continue;
+                }
+
+                double best = 0.0;
+                for (int rep = 0; rep < repetitions; rep++)
+                {
+                    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+                    Histogram h = engine == ENGINE_ATOMIC ? atomic_histogram(values.data(), values.size(), spec, shards)
+                                                          : run_engine(engine, values, spec);
+                    double seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+                    best = rep == 0 ? seconds : std::min(best, seconds);
+                    assert(h.total() == size);
+                }
+                std::cout << std::setw(14) << best << std::setw(16) << size / best / 1e6 << std::endl;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Compares the sparse histogram of 64-bit keys against counting into a
+ * tbb::concurrent_hash_map and against sorting the keys and counting runs.
+ * Keys are drawn from a set of random 64-bit keys with an exponential
+ * popularity, so a few keys are hot and most are rare, and a share of them
+ * are small keys.
+ *
+ * @param size number of keys
+ * @param distinct number of distinct random keys to draw from
+ * @param repetitions number of times each approach is run
+ */
+void run_sparse_benchmark(int size, int distinct, int repetitions)
+{
+    std::mt19937_64 gen(std::random_device{}());
+    std::vector<uint64_t> pool(distinct);
+    for (uint64_t &key : pool)
+    {
+        key = gen();
+    }
+    std::exponential_distribution<> popularity(8.0 / distinct);
+    std::uniform_int_distribution<uint64_t> small(0, SPARSE_SMALL_KEYS - 1);
+    std::vector<uint64_t> keys(size);
+    for (uint64_t &key : keys)
+    {
+        key = gen() % 8 == 0 ? small(gen) : pool[std::min<size_t>(distinct - 1, size_t(popularity(gen)))];
+    }
+
+    StageProfiler &profiler = StageProfiler::instance();
+    profiler.reset();
+    for (int rep = 0; rep < repetitions; rep++)
+    {
+        ScopedStageTimer sparse_timer("sparse", "total");
+        std::vector<SparseBin> sparse = sparse_histogram(keys.data(), keys.size());
+        sparse_timer.stop();
+
+        ScopedStageTimer map_timer("hash_map", "total");
+        std::vector<SparseBin> map = sparse_histogram_concurrent_map(keys.data(), keys.size());
+        map_timer.stop();
+
+        ScopedStageTimer sort_timer("sort_rle", "total");
+        std::vector<SparseBin> sorted = sparse_histogram_sort(keys.data(), keys.size());
+        sort_timer.stop();
+
+        auto same = [](const SparseBin &a, const SparseBin &b)
+        {
+            return a.key == b.key && a.count == b.count && a.cumulative == b.cumulative;
+        };
+        assert(sparse.size() == sorted.size() && std::equal(sparse.begin(), sparse.end(), sorted.begin(), same));
+        assert(map.size() == sorted.size() && std::equal(map.begin(), map.end(), sorted.begin(), same));
+        assert(sparse.back().cumulative == size);
+        if (rep == 0)
+        {
+            std::cout << "Keys: " << size << ", distinct: " << sparse.size() << ", repetitions: " << repetitions
+                      << std::endl
+                      << std::endl;
+        }
+    }
+    profiler.print(std::cout);
+}
+
+/**
+ * @brief Reads a non-negative integer argument.
+ *
+ * @param text argument to be read
+ * @param value integer read
+ * @return true if the whole argument is a non-negative int
+ */
+bool parse_count(const char *text, int &value)
+{
+    char *end;
+    errno = 0;
+    const long parsed = std::strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || parsed < 0 || parsed > INT_MAX)
+    {
+        return false;
+    }
+    value = int(parsed);
+    return true;
+}
+
+/**
+ * @brief Worker of the shared-memory benchmark: generates its shard from its
+ * region index and counts it into its region of the shared segment.
+ *
+ * @param argc number of arguments
+ * @param argv SHARED_MEMORY_WORKER, segment name, region, shard size and max
+ * @return int exit status, 0 if the shard was counted
+ */
+int run_shared_memory_worker(int argc, char *argv[])
+{
+    SharedHistogram shared;
+    if (argc != 6 || !shared.open(argv[2]))
+    {
+        std::cerr << "Could not open the shared histogram" << std::endl;
+        return 1;
+    }
+    int region, shard_size, max;
+    if (!parse_count(argv[3], region) || !parse_count(argv[4], shard_size) || !parse_count(argv[5], max))
+    {
+        std::cerr << "Invalid region, shard size or max" << std::endl;
+        return 1;
+    }
+    std::vector<int> values = seeded_vector(shard_size, max, region);
+    if (!shared.accumulate(region, values.data(), values.size()))
+    {
+        std::cerr << "Region " << region << " is not one of the " << shared.processes() << " of the segment"
+                  << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Splits a dataset into shards counted by as many processes, each one
+ * into its own region of a shared memory segment, and merges the regions.
+ * The result is checked against counting all the shards in this process.
+ *
+ * @param processes number of worker processes
+ * @param shard_size number of values of each shard
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_shared_memory_benchmark(int processes, int shard_size, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    const std::string name = "/sac_tbb_" + std::to_string(getpid());
+    SharedHistogram shared;
+    if (!shared.create(name, spec, processes))
+    {
+        std::cerr << "Could not create the shared memory segment " << name << std::endl;
+        return;
+    }
+
+    StageProfiler &profiler = StageProfiler::instance();
+    profiler.reset();
+    ScopedStageTimer total_timer("shared_memory", "total");
+    std::vector<pid_t> workers;
+    for (int p = 0; p < processes; p++)
+    {
+        workers.push_back(spawn_self({SHARED_MEMORY_WORKER, name, std::to_string(p), std::to_string(shard_size),
+                                      std::to_string(max)}));
+    }
+    bool ok = true;
+    for (pid_t worker : workers)
+    {
+        ok = wait_process(worker) && ok;
+    }
+    if (!ok || !shared.wait(1.0))
+    {
+        std::cerr << "Some worker did not count its shard" << std::endl;
+        return;
+    }
+    Histogram merged = shared.merge();
+    total_timer.stop();
+
+    // The total includes spawning the workers and generating their shards
+    std::cout << processes << " processes, " << shard_size << " values each:";
+    for (int64_t c : merged.cumulative)
+    {
+        std::cout << " " << c;
+    }
+    std::cout << std::endl
+              << std::endl;
+    profiler.print(std::cout);
+
+    std::vector<int> all;
+    for (int p = 0; p < processes; p++)
+    {
+        std::vector<int> shard = seeded_vector(shard_size, max, p);
+        all.insert(all.end(), shard.begin(), shard.end());
+    }
+    assert(merged.cumulative == privatized_histogram(all, spec).cumulative);
+}
+
+/**
+ * @brief Scatters the shards of a dataset to worker processes on this host
+ * and gathers their partial histograms, over a Unix socket and over TCP on
+ * localhost, and measures how the merge latency grows with the number of
+ * shards.
+ *
+ * @param workers number of worker processes
+ * @param size number of elements of the vector
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ * @param max_shards largest number of shards, doubling from 1
+ */
+void run_cluster_benchmark(int workers, int size, int max, int bin_span, int max_shards)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    const std::vector<int> values = random_vector(size, max);
+    const Histogram expected = privatized_histogram(values, spec);
+    const std::vector<std::string> addresses = {"unix:/tmp/sac_tbb_" + std::to_string(getpid()) + ".sock",
+                                                "tcp:127.0.0.1:0"};
+
+    std::cout << std::left << std::setw(12) << "TRANSPORT" << std::right << std::setw(8) << "SHARDS" << std::setw(20)
+              << "SCATTER/GATHER (ms)" << std::setw(14) << "MERGE (ms)" << std::endl;
+    for (const std::string &requested : addresses)
+    {
+        SocketTransport transport;
+        ClusterCoordinator coordinator(transport);
+        if (!coordinator.listen(requested))
+        {
+            std::cerr << "Could not listen on " << requested << std::endl;
+            continue;
+        }
+        std::vector<pid_t> pids;
+        for (int w = 0; w < workers; w++)
+        {
+            pids.push_back(spawn_self({CLUSTER_WORKER, coordinator.address()}));
+        }
+        auto alive = [&pids]
+        {
+            return std::all_of(pids.begin(), pids.end(), process_running);
+        };
+        if (!coordinator.accept_workers(workers, alive))
+        {
+            std::cerr << "Workers did not connect to " << coordinator.address() << std::endl;
+            coordinator.stop();
+            for (pid_t pid : pids)
+            {
+                stop_process(pid);
+            }
+            continue;
+        }
+
+        for (int shards = 1; shards <= max_shards; shards *= 2)
+        {
+            Histogram result;
+            ClusterTimings timings;
+            if (!coordinator.run(values.data(), values.size(), spec, shards, result, timings))
+            {
+                std::cerr << "Could not gather " << shards << " shards" << std::endl;
+                break;
+            }
+            assert(result.cumulative == expected.cumulative);
+            std::cout << std::left << std::setw(12) << requested.substr(0, requested.find(':')) << std::right
+                      << std::setw(8) << shards << std::setw(20) << timings.scatter_gather * 1e3 << std::setw(14)
+                      << timings.merge * 1e3 << std::endl;
+        }
+        coordinator.stop();
+        for (pid_t pid : pids)
+        {
+            wait_process(pid);
+        }
+    }
+}
+
+/**
+ * @brief Runs a histogram daemon in another process, stores a dataset in it
+ * and measures the latency of its queries, first from a single client and
+ * then from several concurrent ones, whose requests are batched.
+ *
+ * @param clients number of concurrent clients
+ * @param queries number of queries of each run
+ * @param size number of elements of the dataset
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_daemon_benchmark(int clients, int queries, int size, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    const std::vector<int> values = random_vector(size, max);
+    const std::string address = "unix:/tmp/sac_tbb_daemon_" + std::to_string(getpid()) + ".sock";
+    const pid_t pid = spawn_self({DAEMON_MODE, address});
+
+    // The daemon may not be listening yet
+    SocketTransport transport;
+    DaemonClient client(transport);
+    for (int attempt = 0; attempt < 100 && !client.connect(address); attempt++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    uint64_t version;
+    if (!client.put(1, values, version))
+    {
+        std::cerr << "Could not reach the daemon at " << address << std::endl;
+        wait_process(pid);
+        return;
+    }
+
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    const Histogram expected = privatized_histogram(values, spec);
+    const double in_process = (oneapi::tbb::tick_count::now() - t0).seconds();
+
+    std::cout << std::left << std::setw(12) << "CLIENTS" << std::right << std::setw(16) << "LATENCY (us)"
+              << std::setw(16) << "QUERIES/S" << std::endl;
+    for (int threads : {1, clients})
+    {
+        std::vector<char> valid(threads);
+        oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+        std::vector<std::thread> callers;
+        for (int c = 0; c < threads; c++)
+        {
+            callers.emplace_back([&, c]
+                                 {
+                                     DaemonClient caller(transport);
+                                     valid[c] = caller.connect(address);
+                                     for (int q = 0; valid[c] && q < queries / threads; q++)
+                                     {
+                                         Histogram result;
+                                         uint64_t seen;
+                                         valid[c] = caller.histogram(1, spec, result, seen) && seen == version &&
+                                                    result.cumulative == expected.cumulative;
+                                     }
+                                 });
+        }
+        for (std::thread &caller : callers)
+        {
+            caller.join();
+        }
+        const double seconds = (oneapi::tbb::tick_count::now() - t1).seconds();
+        assert(std::find(valid.begin(), valid.end(), 0) == valid.end());
+        const int answered = queries / threads * threads;
+        std::cout << std::left << std::setw(12) << threads << std::right << std::setw(16)
+                  << seconds / (answered / threads) * 1e6 << std::setw(16) << answered / seconds << std::endl;
+    }
+    std::cout << std::endl
+              << "In-process histogram: " << in_process * 1e6 << " us" << std::endl;
+
+    std::vector<double> percentiles;
+    if (client.quantiles(1, spec, COMMON_QUANTILES, percentiles, version))
+    {
+        std::cout << "Percentiles from the daemon:";
+        for (size_t i = 0; i < percentiles.size(); i++)
+        {
+            std::cout << " p" << COMMON_QUANTILES[i] * 100 << "=" << percentiles[i];
+        }
+        std::cout << std::endl;
+    }
+    client.shutdown();
+    wait_process(pid);
+}
+
+/**
+ * @brief Appends batches of values to a vector and compares refreshing an
+ * incremental histogram bound to it against counting the whole vector again.
+ * Then changes batches of values in place and compares applying them as
+ * updates against counting again.
+ *
+ * @param size initial number of elements of the vector
+ * @param appends number of batches appended
+ * @param batch number of values of each batch, appended or changed
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_incremental_benchmark(int size, int appends, int batch, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    std::vector<int> values = random_vector(size, max);
+    values.reserve(size_t(size) + size_t(appends) * batch);
+    IncrementalHistogram incremental(values, spec);
+
+    double refresh_seconds = 0.0, full_seconds = 0.0;
+    for (int a = 0; a < appends; a++)
+    {
+        const std::vector<int> tail = random_vector(batch, max);
+        values.insert(values.end(), tail.begin(), tail.end());
+
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        const Histogram &refreshed = incremental.refresh();
+        oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+        const Histogram full = privatized_histogram(values, spec);
+        oneapi::tbb::tick_count t2 = oneapi::tbb::tick_count::now();
+        refresh_seconds += (t1 - t0).seconds();
+        full_seconds += (t2 - t1).seconds();
+        assert(refreshed.cumulative == full.cumulative);
+    }
+
+    std::cout << appends << " appends of " << batch << " values to " << size << " values" << std::endl
+              << "Incremental refresh: " << refresh_seconds / appends * 1e6 << " us" << std::endl
+              << "Full recount:        " << full_seconds / appends * 1e6 << " us" << std::endl
+              << "Speedup:             " << full_seconds / refresh_seconds << "x" << std::endl
+              << std::endl;
+
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<size_t> index(0, values.size() - 1);
+    double update_seconds = 0.0;
+    full_seconds = 0.0;
+    for (int a = 0; a < appends; a++)
+    {
+        const std::vector<int> changed = random_vector(batch, max);
+        std::vector<ValueUpdate> updates(batch);
+        for (int u = 0; u < batch; u++)
+        {
+            const size_t i = index(gen);
+            int &value = values[i];
+            updates[u] = ValueUpdate{i, value, changed[u]};
+            value = changed[u];
+        }
+
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        incremental.update(updates);
+        const Histogram &updated = incremental.histogram();
+        oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+        const Histogram full = privatized_histogram(values, spec);
+        oneapi::tbb::tick_count t2 = oneapi::tbb::tick_count::now();
+        update_seconds += (t1 - t0).seconds();
+        full_seconds += (t2 - t1).seconds();
+        assert(updated.cumulative == full.cumulative);
+    }
+
+    std::cout << appends << " batches of " << batch << " values changed in place" << std::endl
+              << "Delta update: " << update_seconds / appends * 1e6 << " us" << std::endl
+              << "Full recount: " << full_seconds / appends * 1e6 << " us" << std::endl
+              << "Speedup:      " << full_seconds / update_seconds << "x" << std::endl;
+}
+
+/**
+ * @brief Compares computing the histograms of many small arrays one call at a
+ * time against computing them all in one batch.
+ *
+ * @param arrays number of arrays
+ * @param min_size fewest values of an array
+ * @param max_size most values of an array
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_batch_benchmark(int arrays, int min_size, int max_size, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<int> sizes(min_size, max_size);
+    std::vector<int> offsets = {0};
+    for (int a = 0; a < arrays; a++)
+    {
+        offsets.push_back(offsets.back() + sizes(gen));
+    }
+    const std::vector<int> values = random_vector(offsets.back(), max);
+    std::vector<ValueSpan> spans;
+    for (int a = 0; a < arrays; a++)
+    {
+        spans.push_back(ValueSpan{values.data() + offsets[a], size_t(offsets[a + 1] - offsets[a])});
+    }
+
+    // A single stage around the loop, so the engine calls inside it are not profiled one by one
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    PROFILE_STAGE(separate_timer, "batch", "separate");
+    std::vector<Histogram> separate;
+    for (const ValueSpan &span : spans)
+    {
+        separate.push_back(privatized_histogram(span.values, span.size, spec));
+    }
+    PROFILE_STOP(separate_timer);
+    oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+    const BatchHistograms batch = batch_histograms(spans, spec);
+    oneapi::tbb::tick_count t2 = oneapi::tbb::tick_count::now();
+
+    for (int a = 0; a < arrays; a++)
+    {
+        assert(std::equal(separate[a].cumulative.begin(), separate[a].cumulative.end(), batch.cumulative(a)));
+    }
+    std::cout << arrays << " arrays of " << min_size << " to " << max_size << " values" << std::endl
+              << "One call per array: " << (t1 - t0).seconds() * 1e3 << " ms" << std::endl
+              << "One batch:          " << (t2 - t1).seconds() * 1e3 << " ms" << std::endl
+              << "Speedup:            " << (t1 - t0).seconds() / (t2 - t1).seconds() << "x" << std::endl;
+}
+
+/**
+ * @brief Compares the segmented engine against a parallel_for over the
+ * segments, on many small segments and a few huge ones.
+ *
+ * @param segments number of small segments
+ * @param segment_size most values of a small segment
+ * @param huge number of huge segments, placed among the small ones; 0 for
+ * none
+ * @param huge_size values of a huge segment
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_segmented_benchmark(int segments, int segment_size, int huge, int huge_size, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<int> sizes(0, segment_size);
+    std::vector<size_t> offsets = {0};
+    for (int s = 0; s < segments + huge; s++)
+    {
+        const bool is_huge = huge > 0 && s % ((segments + huge) / huge) == 0;
+        offsets.push_back(offsets.back() + size_t(is_huge ? huge_size : sizes(gen)));
+    }
+    const std::vector<int> values = random_vector(int(offsets.back()), max);
+
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    std::vector<int64_t> per_segment((offsets.size() - 1) * NUM_BINS);
+    oneapi::tbb::parallel_for(size_t(0), offsets.size() - 1, [&](size_t s)
+                              {
+                                  int64_t *row = per_segment.data() + s * NUM_BINS;
+                                  for (size_t i = offsets[s]; i < offsets[s + 1]; i++)
+                                  {
+                                      row[spec.bin_of(values[i])]++;
+                                  }
+                                  for (int j = 1; j < NUM_BINS; j++)
+                                  {
+                                      row[j] += row[j - 1];
+                                  }
+                              });
+    oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+    const SegmentedHistograms segmented = segmented_histograms(values, offsets, spec);
+    oneapi::tbb::tick_count t2 = oneapi::tbb::tick_count::now();
+
+    assert(segmented.cumulative == per_segment);
+    std::cout << segments << " segments of up to " << segment_size << " values and " << huge << " of " << huge_size
+              << " values" << std::endl
+              << "Parallel over segments: " << (t1 - t0).seconds() * 1e3 << " ms" << std::endl
+              << "Segmented engine:       " << (t2 - t1).seconds() * 1e3 << " ms" << std::endl;
+}
+
+/**
+ * @brief Computes a histogram in the background while the calling thread
+ * polls it, then starts another one and cancels it, measuring how long the
+ * threads take to stop.
+ *
+ * @param size number of elements of the vector
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ * @param cancel_after seconds after which the second histogram is canceled
+ */
+void run_async_benchmark(int size, int max, int bin_span, double cancel_after)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    const std::vector<int> values = random_vector(size, max);
+    oneapi::tbb::task_arena arena;
+
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    HistogramFuture future = async_histogram(arena, values, spec);
+    int polls = 0;
+    while (!future.poll())
+    {
+        polls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+    assert(!future.canceled());
+    assert(future.get().cumulative == privatized_histogram(values, spec).cumulative);
+    std::cout << "Background histogram: " << seconds * 1e3 << " ms, polled " << polls << " times" << std::endl;
+
+    HistogramFuture canceled = async_histogram(arena, values, spec);
+    std::this_thread::sleep_for(std::chrono::duration<double>(cancel_after));
+    oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+    canceled.cancel();
+    canceled.wait();
+    std::cout << "Canceled after " << cancel_after * 1e3 << " ms: "
+              << (canceled.canceled() ? "stopped in " : "had already finished, in ")
+              << (oneapi::tbb::tick_count::now() - t1).seconds() * 1e3 << " ms" << std::endl;
+}
+
+#if COROUTINES_SUPPORTED
+/**
+ * @brief Coroutine started by its caller and never awaited, which destroys
+ * itself when it finishes.
+ *
+ */
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * @brief Awaits the histogram of a vector and counts itself as finished.
+ *
+ * @param arena arena whose threads compute the histogram
+ * @param values values to be classified
+ * @param spec bins of the histogram
+ * @param result histogram of the values
+ * @param pending coroutines still awaiting their histograms
+ */
+DetachedTask histogram_coroutine(oneapi::tbb::task_arena &arena, const std::vector<int> &values, BinSpec spec,
+                                 Histogram &result, std::atomic<int> &pending)
+{
+    result = co_await await_histogram(arena, values, spec);
+    pending--;
+}
+
+/**
+ * @brief Starts several coroutines that await histograms at the same time;
+ * the calling thread is free until they all resume.
+ *
+ * @param coroutines number of coroutines, each with its own vector
+ * @param size number of elements of each vector
+ * @param max maximum integer value allowed
+ * @param bin_span integer with the range of a bin
+ */
+void run_coroutine_benchmark(int coroutines, int size, int max, int bin_span)
+{
+    const BinSpec spec{bin_span, NUM_BINS};
+    std::vector<std::vector<int>> vectors;
+    for (int c = 0; c < coroutines; c++)
+    {
+        vectors.push_back(random_vector(size, max));
+    }
+    std::vector<Histogram> results(coroutines);
+    std::atomic<int> pending{coroutines};
+    oneapi::tbb::task_arena arena;
+
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    for (int c = 0; c < coroutines; c++)
+    {
+        histogram_coroutine(arena, vectors[c], spec, results[c], pending);
+    }
+    const double launched = (oneapi::tbb::tick_count::now() - t0).seconds();
+    while (pending > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+
+    for (int c = 0; c < coroutines; c++)
+    {
+        assert(results[c].cumulative == privatized_histogram(vectors[c], spec).cumulative);
+    }
+    std::cout << coroutines << " coroutines suspended in " << launched * 1e3 << " ms, all resumed after "
+              << seconds * 1e3 << " ms" << std::endl;
+}
+#endif
+
+/**
+ * @brief Main function. Calls both parallel and sequential solutions for the
+ * same array of values and computes the time they take to finish. With
+ * PROFILE enabled, it also benchmarks them on a larger vector to break the
+ * time down into the map, reduce and scan stages.
+ *
+ * @return int exit status
+ */
+int main(int argc, char *argv[])
+{
+    // Processes spawned by the shared-memory benchmark only count their shard
+    if (argc > 1 && argv[1] == SHARED_MEMORY_WORKER)
+    {
+        return run_shared_memory_worker(argc, argv);
+    }
+    if (argc == 3 && argv[1] == CLUSTER_WORKER)
+    {
+        SocketTransport transport;
+        return run_cluster_worker(transport, argv[2]);
+    }
+    if (argc == 3 && argv[1] == DAEMON_MODE)
+    {
+        SocketTransport transport;
+        HistogramDaemon daemon(transport);
+        if (!daemon.start(argv[2]))
+        {
+            std::cerr << "Could not listen on " << argv[2] << std::endl;
+            return 1;
+        }
+        daemon.wait();
+        return 0;
+    }
+
+#if PROFILE && PERF_COUNTERS
+    // Counters are attached to each thread, so start before TBB creates its workers
+    PerfCounterMonitor::instance().start();
+#endif
+#if PROFILE && UTILIZATION
+    UtilizationMonitor::instance().start();
+#endif
+
+    const int N = 10;
+    const int MAX_VALUE = 120;
+
+    // Benchmark size for the planner and the stage breakdown
+    const int BENCHMARK_SIZE = 1 << 22;
+
+    // Memory available to the engine chosen by the planner
+    const int64_t MEMORY_BUDGET = 64LL << 20;
+    std::vector<int> values = random_vector(N, MAX_VALUE);
+
+    // Sort vector just in case
+    std::sort(values.begin(), values.end());
+
+#if DEBUG
+    std::cout << std::endl
+              << "Vector: [";
+    for (int i = 0; i < values.size(); i++)
+    {
+        std::cout << values[i];
+
+        if (i < values.size() - 1)
+        {
+            std::cout << ", ";
+        }
+    }
+    std::cout << "]" << std::endl
+              << std::endl;
+#endif
+
+    // Get the biggest element and compute the bin size from it
+    const int BIN_SPAN = std::ceil(MAX_VALUE / NUM_BINS);
+
+    std::cout << std::endl
+              << "NUMBER OF BINS: " << NUM_BINS << std::endl
+              << std::endl;
+
+    // Distribute the bins evenly
+    auto bin_range_values = std::vector<int>(NUM_BINS);
+    for (int i = 0; i < NUM_BINS; i++)
+    {
+        bin_range_values[i] = MAX_VALUE - (NUM_BINS - 1 - i) * BIN_SPAN;
+
+        int previous = 0;
+        if (i > 0)
+        {
+            previous = bin_range_values[i - 1] + 1;
+        }
+        std::cout << "BIN " << i + 1 << ": " << previous << " - " << bin_range_values[i] << std::endl
+                  << std::endl;
+    }
+
+    std::cout << std::endl
+              << "=== PARALLEL SOLUTION =======================================" << std::endl
+              << std::endl;
+    oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+    std::array<int, NUM_BINS> parallel_histogram = parallel_solution(values, BIN_SPAN);
+    double parallel_time = (oneapi::tbb::tick_count::now() - t0).seconds();
+    print_histogram(parallel_histogram);
+    std::cout << "\nTime: " << parallel_time << "seconds" << std::endl
+              << std::endl;
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+
+    std::cout << std::endl
+              << "=== SEQUENTIAL SOLUTION =====================================" << std::endl
+              << std::endl;
+    oneapi::tbb::tick_count t1 = oneapi::tbb::tick_count::now();
+    std::array<int, NUM_BINS> sequential_histogram = sequential_solution(values, BIN_SPAN);
+    double sequential_time = (oneapi::tbb::tick_count::now() - t1).seconds();
+    print_histogram(sequential_histogram);
+    std::cout << "\nTime: " << sequential_time << "seconds" << std::endl
+              << std::endl;
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+
+    std::cout << std::endl
+              << "=== ENGINE PLANNER ==========================================" << std::endl
+              << std::endl;
+    EnginePlan plan = plan_engine(PlanRequest{BENCHMARK_SIZE, sizeof(int), NUM_BINS, MEMORY_BUDGET});
+    std::cout << plan.explanation << std::endl;
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+
+#if PROFILE
+    // Settings of the stage breakdown
+    const int REPETITIONS = 5;
+    const std::string BENCHMARK_FILE = "benchmark.csv";
+
+    std::cout << std::endl
+              << "=== STAGE BREAKDOWN =========================================" << std::endl
+              << std::endl;
+    run_benchmark(BENCHMARK_SIZE, MAX_VALUE, BIN_SPAN, REPETITIONS, BENCHMARK_FILE);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if BIN_SCALING
+    // Settings of the benchmark over bin counts
+    const int SCALING_SIZE = 1 << 24;
+    const int SCALING_REPETITIONS = 3;
+    const int64_t SCALING_MEMORY_BUDGET = 2LL << 30;
+
+    std::cout << std::endl
+              << "=== BIN SCALING =============================================" << std::endl
+              << std::endl;
+    run_bin_scaling_benchmark(SCALING_SIZE, SCALING_REPETITIONS, SCALING_MEMORY_BUDGET);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if SHARED_MEMORY
+    // Settings of the benchmark over several processes
+    const int SHARED_MEMORY_PROCESSES = 4;
+    const int SHARED_MEMORY_SHARD_SIZE = 1 << 22;
+
+    std::cout << std::endl
+              << "=== SHARED MEMORY ===========================================" << std::endl
+              << std::endl;
+    run_shared_memory_benchmark(SHARED_MEMORY_PROCESSES, SHARED_MEMORY_SHARD_SIZE, MAX_VALUE, BIN_SPAN);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if CLUSTER
+    // Settings of the scatter/gather benchmark
+    const int CLUSTER_WORKERS = 4;
+    const int CLUSTER_SIZE = 1 << 22;
+    const int CLUSTER_MAX_SHARDS = 64;
+
+    std::cout << std::endl
+              << "=== CLUSTER =================================================" << std::endl
+              << std::endl;
+    run_cluster_benchmark(CLUSTER_WORKERS, CLUSTER_SIZE, MAX_VALUE, BIN_SPAN, CLUSTER_MAX_SHARDS);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if DAEMON
+    // Settings of the benchmark of the resident daemon
+    const int DAEMON_CLIENTS = 8;
+    const int DAEMON_QUERIES = 2000;
+    const int DAEMON_SIZE = 1 << 20;
+
+    std::cout << std::endl
+              << "=== DAEMON ==================================================" << std::endl
+              << std::endl;
+    run_daemon_benchmark(DAEMON_CLIENTS, DAEMON_QUERIES, DAEMON_SIZE, MAX_VALUE, BIN_SPAN);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if INCREMENTAL
+    // Settings of the benchmark of appends
+    const int INCREMENTAL_SIZE = 1 << 22;
+    const int INCREMENTAL_APPENDS = 20;
+    const int INCREMENTAL_BATCH = INCREMENTAL_SIZE / 1000;
+
+    std::cout << std::endl
+              << "=== INCREMENTAL =============================================" << std::endl
+              << std::endl;
+    run_incremental_benchmark(INCREMENTAL_SIZE, INCREMENTAL_APPENDS, INCREMENTAL_BATCH, MAX_VALUE, BIN_SPAN);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if BATCH
+    // Settings of the benchmark of many small arrays
+    const int BATCH_ARRAYS = 100000;
+    const int BATCH_MIN_SIZE = 10;
+    const int BATCH_MAX_SIZE = 1000;
+
+    std::cout << std::endl
+              << "=== BATCH ===================================================" << std::endl
+              << std::endl;
+    run_batch_benchmark(BATCH_ARRAYS, BATCH_MIN_SIZE, BATCH_MAX_SIZE, MAX_VALUE, BIN_SPAN);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if SEGMENTED
+    // Settings of the benchmark of skewed segments
+    const int SEGMENTED_SEGMENTS = 1000000;
+    const int SEGMENTED_SEGMENT_SIZE = 16;
+    const int SEGMENTED_HUGE = 4;
+    const int SEGMENTED_HUGE_SIZE = 1 << 22;
+
+    std::cout << std::endl
+              << "=== SEGMENTED ===============================================" << std::endl
+              << std::endl;
+    run_segmented_benchmark(SEGMENTED_SEGMENTS, SEGMENTED_SEGMENT_SIZE, SEGMENTED_HUGE, SEGMENTED_HUGE_SIZE, MAX_VALUE,
+                            BIN_SPAN);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if ASYNC
+    // Settings of the benchmark of background histograms
+    const int ASYNC_SIZE = 1 << 25;
+    const double ASYNC_CANCEL_AFTER = 0.01;
+
+    std::cout << std::endl
+              << "=== ASYNC ===================================================" << std::endl
+              << std::endl;
+    run_async_benchmark(ASYNC_SIZE, MAX_VALUE, BIN_SPAN, ASYNC_CANCEL_AFTER);
+#if COROUTINES_SUPPORTED
+    // Built with -std=c++20: histograms awaited by coroutines
+    const int ASYNC_COROUTINES = 8;
+    std::cout << std::endl;
+    run_coroutine_benchmark(ASYNC_COROUTINES, ASYNC_SIZE / ASYNC_COROUTINES, MAX_VALUE, BIN_SPAN);
+#endif
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
+
+#if SPARSE
+    // Settings of the benchmark over 64-bit keys
+    const int SPARSE_SIZE = 1 << 24;
+    const int SPARSE_DISTINCT = 1 << 20;
+    const int SPARSE_REPETITIONS = 3;
+
+    std::cout << std::endl
+              << "=== SPARSE KEYS =============================================" << std::endl
+              << std::endl;
+    run_sparse_benchmark(SPARSE_SIZE, SPARSE_DISTINCT, SPARSE_REPETITIONS);
+    std::cout << "=============================================================" << std::endl
+              << std::endl;
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,163 @@
+// Replacements of the global allocation functions that count the heap in
+// HeapCounters. Compile this file with main.cpp when MEMORY_ACCOUNTING is set
+// to 1; it may only be linked once per program.
+//
+// Every block keeps its size in the size_t right in front of it, within a
+// header as large as the alignment of the block, so the pointer returned keeps
+// the alignment that was asked for.
+
+#include "memory_accounting.h"
+
+extern const bool MEMORY_ACCOUNTING_LINKED = true;
+
+namespace
+{
+    size_t header_bytes(size_t alignment)
+    {
+        return std::max(alignment, alignof(std::max_align_t));
+    }
+
+    void *allocate(size_t size, size_t alignment)
+    {
+        const size_t header = header_bytes(alignment);
+        void *block;
+        if (alignment <= alignof(std::max_align_t))
+        {
+            block = std::malloc(header + size);
+        }
+        else
+        {
+            // aligned_alloc wants a multiple of the alignment
+            block = std::aligned_alloc(alignment, (header + size + alignment - 1) / alignment * alignment);
+        }
+        if (block == nullptr)
+        {
+            return nullptr;
+        }
+        char *ptr = static_cast<char *>(block) + header;
+        reinterpret_cast<size_t *>(ptr)[-1] = size;
+        HeapCounters::instance().on_allocate(int64_t(size));
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t alignment) noexcept
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        char *bytes = static_cast<char *>(ptr);
+        HeapCounters::instance().on_deallocate(int64_t(reinterpret_cast<size_t *>(bytes)[-1]));
+        std::free(bytes - header_bytes(alignment));
+    }
+
+    void *allocate_or_throw(size_t size, size_t alignment)
+    {
+        void *ptr = allocate(size, alignment);
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+}
+
+void *operator new(size_t size)
+{
+    return allocate_or_throw(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size)
+{
+    return allocate_or_throw(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    return allocate_or_throw(size, size_t(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return allocate_or_throw(size, size_t(alignment));
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate(size, size_t(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate(size, size_t(alignment));
+}
+
+void operator delete(void *ptr) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    deallocate(ptr, size_t(alignment));
+}
@@ -0,0 +1,166 @@
+#ifndef MEMORY_ACCOUNTING_H
+#define MEMORY_ACCOUNTING_H
+
+#ifndef MEMORY_ACCOUNTING
+#define MEMORY_ACCOUNTING 0 // Set to 1 to count the heap used by each stage (link memory_accounting.cpp); 0 to deactivate
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define RUSAGE_SUPPORTED 1
+#else
+#define RUSAGE_SUPPORTED 0
+#endif
+
+/**
+ * @brief Heap counters updated by the replacements of the global operator new
+ * and delete in memory_accounting.cpp. Relaxed atomics are enough: they are
+ * only read between stages.
+ *
+ */
+struct HeapCounters
+{
+    std::atomic<int64_t> allocated{0}; // Bytes ever allocated
+    std::atomic<int64_t> live{0};      // Bytes currently allocated
+    std::atomic<int64_t> peak{0};      // Highest value of live since the last reset
+
+    /**
+     * @brief Returns the counters of the process.
+     *
+     * @return HeapCounters& updated by every allocation
+     */
+    static HeapCounters &instance()
+    {
+        static HeapCounters counters;
+        return counters;
+    }
+
+    void on_allocate(int64_t bytes)
+    {
+        allocated.fetch_add(bytes, std::memory_order_relaxed);
+        int64_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        int64_t previous = peak.load(std::memory_order_relaxed);
+        while (now > previous && !peak.compare_exchange_weak(previous, now, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void on_deallocate(int64_t bytes)
+    {
+        live.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+};
+
+#if MEMORY_ACCOUNTING
+// The replacements of the global allocation functions live in
+// memory_accounting.cpp, since a program may only define them once. Referring
+// to this symbol makes the build fail to link if that file is left out.
+extern const bool MEMORY_ACCOUNTING_LINKED;
+static const bool memory_accounting_linked = MEMORY_ACCOUNTING_LINKED;
+#endif
+
+/**
+ * @brief Memory used by the process at a given moment.
+ *
+ */
+struct MemorySnapshot
+{
+    int64_t allocated = 0;     // Heap bytes ever allocated
+    int64_t live = 0;          // Heap bytes currently allocated
+    int64_t max_rss = 0;       // Peak resident set size of the process, in bytes
+    int64_t minor_faults = 0;  // Page faults served without I/O
+    int64_t major_faults = 0;  // Page faults that required I/O
+
+    /**
+     * @brief Takes a snapshot of the heap counters and of getrusage.
+     *
+     * @return MemorySnapshot of the current moment
+     */
+    static MemorySnapshot now()
+    {
+        MemorySnapshot s;
+        s.allocated = HeapCounters::instance().allocated.load(std::memory_order_relaxed);
+        s.live = HeapCounters::instance().live.load(std::memory_order_relaxed);
+#if RUSAGE_SUPPORTED
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+#ifdef __APPLE__
+            s.max_rss = usage.ru_maxrss; // Already in bytes
+#else
+            s.max_rss = int64_t(usage.ru_maxrss) * 1024;
+#endif
+            s.minor_faults = usage.ru_minflt;
+            s.major_faults = usage.ru_majflt;
+        }
+#endif
+        return s;
+    }
+};
+
+/**
+ * @brief Memory used by one run of a stage.
+ *
+ */
+struct MemoryUsage
+{
+    int64_t allocated = 0;    // Heap bytes allocated during the stage
+    int64_t peak = 0;         // Highest heap use during the stage, above what was live when it began
+    int64_t minor_faults = 0;
+    int64_t major_faults = 0;
+};
+
+/**
+ * @brief Measures the memory used between its construction and the call to
+ * stop. Scopes can be nested: each one tracks its own peak and leaves the
+ * peak of the enclosing scope as if it had not been reset.
+ *
+ */
+class MemoryScope
+{
+public:
+    MemoryScope() : start(MemorySnapshot::now())
+    {
+        HeapCounters &heap = HeapCounters::instance();
+        outer_peak = heap.peak.exchange(start.live, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Finishes the measurement.
+     *
+     * @return MemoryUsage since the scope was created
+     */
+    MemoryUsage stop()
+    {
+        HeapCounters &heap = HeapCounters::instance();
+        MemorySnapshot end = MemorySnapshot::now();
+        int64_t peak = heap.peak.load(std::memory_order_relaxed);
+
+        // Give the enclosing scope back the larger of both peaks
+        int64_t restored = std::max(outer_peak, peak);
+        int64_t current = peak;
+        while (current < restored && !heap.peak.compare_exchange_weak(current, restored, std::memory_order_relaxed))
+        {
+        }
+
+        MemoryUsage usage;
+        usage.allocated = end.allocated - start.allocated;
+        usage.peak = std::max<int64_t>(0, peak - start.live);
+        usage.minor_faults = end.minor_faults - start.minor_faults;
+        usage.major_faults = end.major_faults - start.major_faults;
+        return usage;
+    }
+
+private:
+    MemorySnapshot start;
+    int64_t outer_peak;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef MEMORY_ESTIMATE_H
+#define MEMORY_ESTIMATE_H
+
+#include <oneapi/tbb/info.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Ways of computing the cumulative histogram.
+ *
+ */
+enum Engine
+{
+    ENGINE_PARALLEL,   // parallel_solution: map, reduce and scan with TBB
+    ENGINE_SEQUENTIAL, // sequential_solution: the same three steps in sequence
+    ENGINE_PRIVATIZED, // Map and reduce fused, counting into private histograms
+    ENGINE_STREAMING,  // Privatized counting over blocks read from a source
+    ENGINE_ATOMIC,     // Shared histogram, sharded, incremented with atomics
+    ENGINE_PARTITION,  // Radix partition by bucket of bins, then count each bucket in cache
+    NUM_ENGINES
+};
+
+/**
+ * @brief Names of the engines, in the same order as Engine. They are the
+ * names under which their stages are profiled.
+ *
+ */
+const std::array<const char *, NUM_ENGINES> ENGINE_NAMES = {"parallel", "sequential", "privatized", "streaming", "atomic", "partition"};
+
+/**
+ * @brief Values per block and blocks in flight per thread of the streaming
+ * engine, needed to estimate its memory
+ *
+ */
+const int64_t STREAMING_BLOCK_VALUES = 1 << 16;
+const int64_t STREAMING_BLOCKS_IN_FLIGHT = 2;
+
+/**
+ * @brief Bins per bucket and values per block of the partition engine,
+ * needed to estimate its memory
+ *
+ */
+const int64_t PARTITION_BUCKET_BINS = 1 << 14;
+const int64_t PARTITION_BLOCK_VALUES = 1 << 16;
+
+/**
+ * @brief Memory an engine needs to compute a histogram.
+ *
+ */
+struct MemoryEstimate
+{
+    int64_t input_bytes = 0;   // The values, which the caller already holds
+    int64_t working_bytes = 0; // Everything the engine allocates on top of them
+
+    int64_t total() const
+    {
+        return input_bytes + working_bytes;
+    }
+};
+
+/**
+ * @brief Estimates, before running it, the memory an engine will need. The
+ * three-stage engines dominate with the mapped values, one array of num_bins
+ * counters per element; the sequential one also copies its input. The
+ * privatized engines need a few histograms per thread instead, and the
+ * streaming one only holds a few blocks of the input at once. The atomic
+ * engine needs a single shared histogram at least; it only adds shards if
+ * the budget allows it. The partition engine keeps a 16-bit copy of every
+ * bin index, plus the offsets of every block in every bucket.
+ *
+ * @param engine engine to be estimated
+ * @param n number of values
+ * @param num_bins number of bins of the histogram
+ * @param element_bytes size of each value
+ * @param threads number of threads that will run the engine
+ * @return MemoryEstimate with the bytes needed
+ */
+inline MemoryEstimate estimate_memory(Engine engine, int64_t n, int64_t num_bins, int64_t element_bytes = sizeof(int),
+                                      int64_t threads = oneapi::tbb::info::default_concurrency())
+{
+    MemoryEstimate estimate;
+    estimate.input_bytes = n * element_bytes;
+    const int64_t mapped_bytes = n * num_bins * int64_t(sizeof(int));
+    const int64_t histogram_bytes = 2 * num_bins * int64_t(sizeof(int64_t));
+
+    // parallel_reduce may keep a couple of split bodies alive per thread
+    const int64_t private_bytes = 2 * threads * num_bins * int64_t(sizeof(int64_t));
+    const int64_t blocks = STREAMING_BLOCKS_IN_FLIGHT * threads;
+
+    switch (engine)
+    {
+    case ENGINE_PARALLEL:
+        estimate.working_bytes = mapped_bytes + histogram_bytes;
+        break;
+    case ENGINE_SEQUENTIAL:
+        estimate.working_bytes = estimate.input_bytes + mapped_bytes + histogram_bytes;
+        break;
+    case ENGINE_PRIVATIZED:
+        estimate.working_bytes = private_bytes + histogram_bytes;
+        break;
+    case ENGINE_STREAMING:
+        estimate.input_bytes = 0; // Read from the source, never held at once
+        estimate.working_bytes = blocks * (STREAMING_BLOCK_VALUES * element_bytes + num_bins * int64_t(sizeof(int64_t))) +
+                                 histogram_bytes;
+        break;
+    case ENGINE_ATOMIC:
+        estimate.working_bytes = (num_bins + 64 / int64_t(sizeof(int64_t))) * int64_t(sizeof(int64_t)) + histogram_bytes;
+        break;
+    case ENGINE_PARTITION:
+    {
+        const int64_t buckets = (num_bins + PARTITION_BUCKET_BINS - 1) / PARTITION_BUCKET_BINS;
+        const int64_t blocks = (n + PARTITION_BLOCK_VALUES - 1) / PARTITION_BLOCK_VALUES;
+        estimate.working_bytes = n * int64_t(sizeof(uint16_t)) + blocks * buckets * int64_t(sizeof(size_t)) +
+                                 threads * (buckets * 65 + PARTITION_BUCKET_BINS * int64_t(sizeof(int64_t))) +
+                                 histogram_bytes;
+        break;
+    }
+    default:
+        break;
+    }
+    return estimate;
+}
+
+/**
+ * @brief Lists the engines whose estimated memory, input included, fits in a
+ * budget, so the caller can pick one before running anything.
+ *
+ * @param n number of values
+ * @param num_bins number of bins of the histogram
+ * @param budget_bytes memory available
+ * @param element_bytes size of each value
+ * @param threads number of threads that will run the engine
+ * @return std::vector<Engine> that fit, in the order of Engine
+ */
+inline std::vector<Engine> engines_within_budget(int64_t n, int64_t num_bins, int64_t budget_bytes,
+                                                 int64_t element_bytes = sizeof(int),
+                                                 int64_t threads = oneapi::tbb::info::default_concurrency())
+{
+    std::vector<Engine> engines;
+    for (int e = 0; e < NUM_ENGINES; e++)
+    {
+        if (estimate_memory(Engine(e), n, num_bins, element_bytes, threads).total() <= budget_bytes)
+        {
+            engines.push_back(Engine(e));
+        }
+    }
+    return engines;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef PARTITION_ENGINE_H
+#define PARTITION_ENGINE_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include "memory_estimate.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Low bits of the bin index counted inside a bucket. 2^14 bins of
+ * 64-bit counters take 128 KB, which stays in the L2 cache.
+ *
+ */
+const int PARTITION_BUCKET_BITS = 14;
+static_assert(PARTITION_BUCKET_BINS == 1 << PARTITION_BUCKET_BITS, "bucket size used by the memory estimate");
+
+/**
+ * @brief Values partitioned by each task of the first phase
+ *
+ */
+const size_t PARTITION_BLOCK = PARTITION_BLOCK_VALUES;
+
+/**
+ * @brief Bin indices kept by the software write-combining buffer of each
+ * bucket: one 64-byte cache line of 16-bit indices
+ *
+ */
+const int SWWC_ENTRIES = 64 / sizeof(uint16_t);
+
+/**
+ * @brief Partition-then-count engine, for histograms much larger than the
+ * cache, where counting straight into the bins misses on nearly every value.
+ *
+ *  1. Partition: the values are radix-partitioned by the high bits of their
+ *     bin index into buckets of 2^PARTITION_BUCKET_BITS bins. Each block of
+ *     the input first counts how many of its values go to every bucket, an
+ *     exclusive scan gives each block where to write in each bucket, and the
+ *     block scatters the low bits of the bin indices (16 bits each) through a
+ *     software write-combining buffer per bucket, so whole cache lines are
+ *     written at once instead of one scattered store per value.
+ *  2. Count: every bucket is counted by a single task into a private,
+ *     cache-resident array and copied into its own slice of the histogram.
+ *     Buckets own disjoint bins, so nothing has to be merged.
+ *  3. Scan: the cumulative histogram, as in the other engines.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram partition_histogram(const int *values, size_t n, const BinSpec &spec)
+{
+    const size_t bucket_bins = size_t(1) << PARTITION_BUCKET_BITS;
+    const size_t low_mask = bucket_bins - 1;
+    const size_t buckets = (size_t(spec.num_bins) + bucket_bins - 1) / bucket_bins;
+    const size_t blocks = (n + PARTITION_BLOCK - 1) / PARTITION_BLOCK;
+
+    PROFILE_STAGE(partition_timer, "partition", "partition");
+
+    // Values of each block going to each bucket, later turned into offsets
+    std::vector<size_t> offsets(blocks * buckets);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, blocks),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("histogram buckets", r);
+            for (size_t b = r.begin(); b < r.end(); b++)
+            {
+                size_t *row = &offsets[b * buckets];
+                for (size_t i = b * PARTITION_BLOCK; i < std::min(n, (b + 1) * PARTITION_BLOCK); i++)
+                {
+                    row[size_t(spec.bin_of(values[i])) >> PARTITION_BUCKET_BITS]++;
+                }
+            }
+        });
+
+    // Buckets are contiguous, and inside each one the blocks follow in order
+    std::vector<size_t> bucket_begin(buckets + 1);
+    size_t position = 0;
+    for (size_t k = 0; k < buckets; k++)
+    {
+        bucket_begin[k] = position;
+        for (size_t b = 0; b < blocks; b++)
+        {
+            size_t count = offsets[b * buckets + k];
+            offsets[b * buckets + k] = position;
+            position += count;
+        }
+    }
+    bucket_begin[buckets] = position;
+
+    std::vector<uint16_t> partitioned(n);
+    oneapi::tbb::enumerable_thread_specific<std::vector<uint16_t>> buffers(buckets * SWWC_ENTRIES);
+    oneapi::tbb::enumerable_thread_specific<std::vector<uint8_t>> fills(buckets);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, blocks),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("scatter", r);
+            uint16_t *buffer = buffers.local().data();
+            uint8_t *fill = fills.local().data();
+            for (size_t b = r.begin(); b < r.end(); b++)
+            {
+                size_t *cursor = &offsets[b * buckets];
+                for (size_t i = b * PARTITION_BLOCK; i < std::min(n, (b + 1) * PARTITION_BLOCK); i++)
+                {
+                    size_t bin = spec.bin_of(values[i]);
+                    size_t k = bin >> PARTITION_BUCKET_BITS;
+                    uint16_t *line = buffer + k * SWWC_ENTRIES;
+                    line[fill[k]++] = uint16_t(bin & low_mask);
+                    if (fill[k] == SWWC_ENTRIES)
+                    {
+                        std::memcpy(&partitioned[cursor[k]], line, sizeof(uint16_t) * SWWC_ENTRIES);
+                        cursor[k] += SWWC_ENTRIES;
+                        fill[k] = 0;
+                    }
+                }
+
+                // The buffers are flushed at the end of every block, as the
+                // next one writes somewhere else
+                for (size_t k = 0; k < buckets; k++)
+                {
+                    if (fill[k] > 0)
+                    {
+                        std::memcpy(&partitioned[cursor[k]], buffer + k * SWWC_ENTRIES, sizeof(uint16_t) * fill[k]);
+                        cursor[k] += fill[k];
+                        fill[k] = 0;
+                    }
+                }
+            }
+        });
+    PROFILE_STOP(partition_timer);
+
+    PROFILE_STAGE(count_timer, "partition", "count");
+    Histogram h;
+    h.counts.assign(spec.num_bins, 0);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, buckets, 1),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("count", r);
+            std::vector<int64_t> local(bucket_bins);
+            for (size_t k = r.begin(); k < r.end(); k++)
+            {
+                std::fill(local.begin(), local.end(), 0);
+                for (size_t i = bucket_begin[k]; i < bucket_begin[k + 1]; i++)
+                {
+                    local[partitioned[i]]++;
+                }
+
+                const size_t first = k * bucket_bins;
+                const size_t last = std::min(size_t(spec.num_bins), first + bucket_bins);
+                std::copy(local.begin(), local.begin() + (last - first), h.counts.begin() + first);
+            }
+        });
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(scan_timer, "partition", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Partition-then-count engine over a whole vector.
+ *
+ * @see partition_histogram(const int *, size_t, const BinSpec &)
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram partition_histogram(const std::vector<int> &values, const BinSpec &spec)
+{
+    return partition_histogram(values.data(), values.size(), spec);
+}
+
+#endif
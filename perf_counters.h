@@ -0,0 +1,299 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS 1 // Set to 1 to collect hardware counters per stage (Linux only); 0 to deactivate
+#endif
+
+#include <oneapi/tbb/task_scheduler_observer.h>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if PERF_COUNTERS && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#define PERF_COUNTERS_SUPPORTED 1
+#else
+#define PERF_COUNTERS_SUPPORTED 0
+#endif
+
+/**
+ * @brief Hardware events collected for every stage.
+ *
+ */
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    NUM_PERF_COUNTERS
+};
+
+/**
+ * @brief Short names of the events, in the same order as PerfCounter.
+ *
+ */
+const std::array<const char *, NUM_PERF_COUNTERS> PERF_COUNTER_NAMES = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "dtlb_misses"};
+
+/**
+ * @brief Values of every event. Events the machine (or the permissions of the
+ * process) does not allow to count are marked as unavailable.
+ *
+ */
+struct CounterValues
+{
+    std::array<uint64_t, NUM_PERF_COUNTERS> values{};
+    std::array<bool, NUM_PERF_COUNTERS> available{};
+
+    /**
+     * @brief Checks whether at least one event could be counted.
+     *
+     * @return true if any event is available
+     */
+    bool any() const
+    {
+        for (bool a : available)
+        {
+            if (a)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Difference between two readings of the same counters.
+     *
+     * @param earlier reading taken before this one
+     * @return CounterValues with the events counted in between
+     */
+    CounterValues since(const CounterValues &earlier) const
+    {
+        CounterValues delta;
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            delta.available[i] = available[i] && earlier.available[i];
+            delta.values[i] = delta.available[i] && values[i] > earlier.values[i] ? values[i] - earlier.values[i] : 0;
+        }
+        return delta;
+    }
+
+    /**
+     * @brief Accumulates another set of counters into this one.
+     *
+     * @param other counters to be added
+     */
+    void add(const CounterValues &other)
+    {
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            available[i] = available[i] || other.available[i];
+            values[i] += other.values[i];
+        }
+    }
+};
+
+/**
+ * @brief Counters of a single thread, opened with perf_event_open. The events
+ * are grouped under the first one that could be opened so they are scheduled
+ * together; an event the group rejects is retried on its own.
+ *
+ */
+class ThreadCounters
+{
+public:
+    ThreadCounters()
+    {
+        fds.fill(-1);
+#if PERF_COUNTERS_SUPPORTED
+        const std::array<std::pair<uint32_t, uint64_t>, NUM_PERF_COUNTERS> events = {{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        }};
+
+        int leader = -1;
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            fds[i] = open_event(events[i].first, events[i].second, leader);
+            if (fds[i] < 0 && leader >= 0)
+            {
+                fds[i] = open_event(events[i].first, events[i].second, -1);
+            }
+            if (fds[i] >= 0 && leader < 0)
+            {
+                leader = fds[i];
+            }
+        }
+#endif
+    }
+
+    ThreadCounters(const ThreadCounters &) = delete;
+    ThreadCounters &operator=(const ThreadCounters &) = delete;
+
+    ~ThreadCounters()
+    {
+#if PERF_COUNTERS_SUPPORTED
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    /**
+     * @brief Reads the current value of the counters of the thread. The
+     * descriptors belong to the process, so any thread can read them.
+     *
+     * @return CounterValues since the counters were opened
+     */
+    CounterValues read_values() const
+    {
+        CounterValues result;
+#if PERF_COUNTERS_SUPPORTED
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            // value, time enabled, time running (scaled if the PMU was multiplexed)
+            uint64_t data[3] = {0, 0, 0};
+            if (fds[i] >= 0 && ::read(fds[i], data, sizeof(data)) == sizeof(data))
+            {
+                result.available[i] = true;
+                result.values[i] = data[2] > 0 && data[2] < data[1] ? uint64_t(double(data[0]) * data[1] / data[2]) : data[0];
+            }
+        }
+#endif
+        return result;
+    }
+
+private:
+#if PERF_COUNTERS_SUPPORTED
+    static int open_event(uint32_t type, uint64_t config, int group_fd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1; // Allowed without privileges with perf_event_paranoid <= 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return int(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+#endif
+
+    std::array<int, NUM_PERF_COUNTERS> fds;
+};
+
+/**
+ * @brief Keeps the counters of every thread that takes part in the solutions:
+ * the main thread and every TBB worker, which are attached by a global
+ * task_scheduler_observer as soon as they join an arena. A stage is measured
+ * by reading the sum of all threads before and after it.
+ *
+ * If the counters cannot be opened (no PMU, virtual machines, restrictive
+ * perf_event_paranoid, non-Linux systems) every reading is simply marked as
+ * unavailable and the timings are reported without them.
+ *
+ */
+class PerfCounterMonitor
+{
+public:
+    /**
+     * @brief Returns the global monitor.
+     *
+     * @return PerfCounterMonitor& shared by all the stage timers
+     */
+    static PerfCounterMonitor &instance()
+    {
+        static PerfCounterMonitor monitor;
+        return monitor;
+    }
+
+    /**
+     * @brief Attaches the calling thread and starts attaching TBB workers. It
+     * should be called before TBB creates its worker threads, otherwise the
+     * workers are only attached the next time they join an arena.
+     *
+     */
+    void start()
+    {
+        attach_current_thread();
+        observer.observe(true);
+    }
+
+    /**
+     * @brief Opens the counters of the calling thread, once per thread.
+     *
+     */
+    void attach_current_thread()
+    {
+        thread_local bool attached = false;
+        if (attached)
+        {
+            return;
+        }
+        attached = true;
+
+        std::unique_ptr<ThreadCounters> counters(new ThreadCounters());
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.push_back(std::move(counters));
+    }
+
+    /**
+     * @brief Sums the counters of every attached thread.
+     *
+     * @return CounterValues of the whole process since the threads were attached
+     */
+    CounterValues read_values() const
+    {
+        CounterValues total;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::unique_ptr<ThreadCounters> &t : threads)
+        {
+            total.add(t->read_values());
+        }
+        return total;
+    }
+
+private:
+    class Observer : public oneapi::tbb::task_scheduler_observer
+    {
+    public:
+        explicit Observer(PerfCounterMonitor &monitor) : monitor(monitor) {}
+
+        void on_scheduler_entry(bool) override
+        {
+            monitor.attach_current_thread();
+        }
+
+    private:
+        PerfCounterMonitor &monitor;
+    };
+
+    PerfCounterMonitor() : observer(*this) {}
+
+    ~PerfCounterMonitor()
+    {
+        observer.observe(false);
+    }
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadCounters>> threads;
+    Observer observer;
+};
+
+#endif
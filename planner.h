@@ -0,0 +1,198 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "atomic_engine.h"
+#include "engines.h"
+#include "memory_estimate.h"
+#include "partition_engine.h"
+#include <oneapi/tbb/info.h>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Description of a histogram to be computed and of the resources
+ * available to compute it.
+ *
+ */
+struct PlanRequest
+{
+    int64_t n;                  // Number of values
+    int64_t element_bytes;      // Size of each value
+    int64_t num_bins;           // Number of bins of the histogram
+    int64_t memory_budget;      // Bytes available, input included when it is in memory
+    int cores = oneapi::tbb::info::default_concurrency();
+    bool input_in_memory = true; // false when the values can only be streamed
+};
+
+/**
+ * @brief Engine chosen by the planner, its estimated memory and the reasons
+ * for the choice, meant to be shown to whoever runs the histogram.
+ *
+ */
+struct EnginePlan
+{
+    Engine engine;
+    MemoryEstimate estimate;
+    bool fits;
+    std::string explanation;
+};
+
+/**
+ * @brief Number of values below which running in parallel does not pay off
+ *
+ */
+const int64_t PLANNER_SMALL_INPUT = 1 << 12;
+
+/**
+ * @brief Size of a histogram above which counting straight into it misses in
+ * the cache on nearly every value (a conservative last-level cache)
+ *
+ */
+const int64_t PLANNER_CACHE_BYTES = 8 << 20;
+
+/**
+ * @brief Picks the engine that should compute a histogram the fastest without
+ * exceeding the memory budget. Engines are tried from the fastest to the
+ * slowest, skipping the ones that do not fit:
+ *
+ *  1. Privatized, for tiny inputs or a single core, where nothing but one
+ *     counting pass pays off: its body is only split when another thread
+ *     steals work, so on a single core it is one sequential loop.
+ *  2. Partition-then-count, when the histogram is larger than the cache, so
+ *     that every bin is counted while it is in the cache.
+ *  3. Privatized, whose memory grows with cores x bins instead of with the
+ *     input, when the values are in memory.
+ *  4. Atomic, when there are so many bins that cores x bins private copies
+ *     do not fit: a single shared histogram, sharded as far as the budget
+ *     allows.
+ *  5. Partition-then-count for smaller histograms, if nothing above fits.
+ *  6. Streaming, when the values are not in memory or the input itself takes
+ *     the budget: it only needs a few blocks at once.
+ *  7. Three-stage reference, the slowest, as a last resort.
+ *
+ * The sequential engine is never picked: it runs the same three steps as the
+ * reference, which take num_bins times the input in time and memory.
+ *
+ * If nothing fits, the engine needing the least memory is returned with
+ * fits set to false.
+ *
+ * @param request histogram and resources available
+ * @return EnginePlan with the engine chosen and why
+ */
+inline EnginePlan plan_engine(const PlanRequest &request)
+{
+    std::ostringstream why;
+    auto estimate = [&](Engine e)
+    {
+        MemoryEstimate m = estimate_memory(e, request.n, request.num_bins, request.element_bytes, request.cores);
+        if (!request.input_in_memory && e != ENGINE_STREAMING)
+        {
+            m.working_bytes += m.input_bytes; // The values would have to be loaded first
+        }
+        return m;
+    };
+    auto fits = [&](Engine e)
+    {
+        return estimate(e).total() <= request.memory_budget;
+    };
+    auto describe = [&](Engine e)
+    {
+        why << "  " << ENGINE_NAMES[e] << ": " << estimate(e).total() / 1e6 << " MB"
+            << (fits(e) ? "" : " (over budget)") << std::endl;
+    };
+
+    why << "Histogram of " << request.n << " values of " << request.element_bytes << " bytes into "
+        << request.num_bins << " bins, " << request.cores << " cores, budget "
+        << request.memory_budget / 1e6 << " MB" << std::endl
+        << "Estimated memory:" << std::endl;
+    for (int e = 0; e < NUM_ENGINES; e++)
+    {
+        describe(Engine(e));
+    }
+
+    std::vector<std::pair<Engine, std::string>> order;
+    if (request.input_in_memory && (request.n < PLANNER_SMALL_INPUT || request.cores == 1))
+    {
+        order.emplace_back(ENGINE_PRIVATIZED, request.cores == 1 ? "a single core counts in one sequential pass"
+                                                                 : "the input is too small to pay for more than "
+                                                                   "a single counting pass");
+    }
+    const bool larger_than_cache = request.num_bins * int64_t(sizeof(int64_t)) > PLANNER_CACHE_BYTES;
+    if (request.input_in_memory)
+    {
+        if (larger_than_cache)
+        {
+            order.emplace_back(ENGINE_PARTITION, "the histogram is larger than the cache, and partitioning first "
+                                                 "counts every bucket of bins while it is in the cache");
+        }
+        order.emplace_back(ENGINE_PRIVATIZED, "it counts in a single pass with private histograms per thread");
+        order.emplace_back(ENGINE_ATOMIC, "private histograms per thread do not fit, but a shared one does");
+        if (!larger_than_cache)
+        {
+            order.emplace_back(ENGINE_PARTITION, "it is the only engine left that fits with the input in memory");
+        }
+    }
+    order.emplace_back(ENGINE_STREAMING, request.input_in_memory ? "it only keeps a few blocks of the input at once"
+                                                                 : "the values are not in memory and can only be streamed");
+    if (request.input_in_memory)
+    {
+        order.emplace_back(ENGINE_PARALLEL, "it is the only parallel engine left that fits");
+    }
+
+    for (const std::pair<Engine, std::string> &candidate : order)
+    {
+        if (fits(candidate.first))
+        {
+            why << "Chosen: " << ENGINE_NAMES[candidate.first] << ", because " << candidate.second << std::endl;
+            return EnginePlan{candidate.first, estimate(candidate.first), true, why.str()};
+        }
+        why << "Skipped " << ENGINE_NAMES[candidate.first] << ": it does not fit in the budget" << std::endl;
+    }
+
+    // Nothing fits: the smallest footprint is the best that can be done
+    Engine smallest = order.front().first;
+    for (const std::pair<Engine, std::string> &candidate : order)
+    {
+        if (estimate(candidate.first).total() < estimate(smallest).total())
+        {
+            smallest = candidate.first;
+        }
+    }
+    why << "No engine fits in the budget, falling back to the smallest: " << ENGINE_NAMES[smallest] << std::endl;
+    return EnginePlan{smallest, estimate(smallest), false, why.str()};
+}
+
+/**
+ * @brief Runs any engine over a vector of values.
+ *
+ * @param engine engine to be run
+ * @param values array of integers with the values to be classified
+ * @param spec bins of the histogram
+ * @param memory_budget bytes the engine may use, which limits the shards of
+ * the atomic engine
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram run_engine(Engine engine, const std::vector<int> &values, const BinSpec &spec,
+                            int64_t memory_budget = INT64_MAX)
+{
+    switch (engine)
+    {
+    case ENGINE_SEQUENTIAL:
+        return sequential_histogram(values, spec);
+    case ENGINE_PRIVATIZED:
+        return privatized_histogram(values, spec);
+    case ENGINE_STREAMING:
+        return streaming_histogram(vector_source(values), spec);
+    case ENGINE_ATOMIC:
+        return atomic_histogram(values.data(), values.size(), spec, 0, memory_budget);
+    case ENGINE_PARTITION:
+        return partition_histogram(values, spec);
+    case ENGINE_PARALLEL:
+    default:
+        return three_stage_histogram(values, spec);
+    }
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef PROCESSES_H
+#define PROCESSES_H
+
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#define PROCESSES_SUPPORTED 1
+#else
+#define PROCESSES_SUPPORTED 0
+typedef int pid_t;
+#endif
+
+#if PROCESSES_SUPPORTED
+extern char **environ;
+#endif
+
+/**
+ * @brief Starts another instance of this program with the given arguments,
+ * to run as a worker. The program is re-executed instead of forked: TBB has
+ * already started its threads, and a forked child would only keep the one
+ * that called fork.
+ *
+ * @param args arguments after the program name
+ * @return pid_t of the new process, -1 if it could not be started
+ */
+inline pid_t spawn_self(const std::vector<std::string> &args)
+{
+#if PROCESSES_SUPPORTED
+    std::vector<std::string> storage = {"/proc/self/exe"};
+    storage.insert(storage.end(), args.begin(), args.end());
+    std::vector<char *> argv;
+    for (std::string &arg : storage)
+    {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    if (posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, argv.data(), environ) != 0)
+    {
+        return -1;
+    }
+    return pid;
+#else
+    (void)args;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Waits for a process started by spawn_self to finish.
+ *
+ * @param pid process to be waited for
+ * @return true if it exited with status 0
+ */
+inline bool wait_process(pid_t pid)
+{
+#if PROCESSES_SUPPORTED
+    int status = 0;
+    if (pid <= 0 || waitpid(pid, &status, 0) != pid)
+    {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    (void)pid;
+    return false;
+#endif
+}
+
+/**
+ * @brief Whether a process started by spawn_self is still running. A process
+ * that has exited is reaped.
+ *
+ * @param pid process to be checked
+ * @return true if it has not exited yet
+ */
+inline bool process_running(pid_t pid)
+{
+#if PROCESSES_SUPPORTED
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, WNOHANG) == 0;
+#else
+    (void)pid;
+    return false;
+#endif
+}
+
+/**
+ * @brief Terminates a process started by spawn_self and waits for it, so it
+ * is not left running nor as a zombie when it will not be needed.
+ *
+ * @param pid process to be terminated
+ */
+inline void stop_process(pid_t pid)
+{
+#if PROCESSES_SUPPORTED
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        wait_process(pid);
+    }
+#else
+    (void)pid;
+#endif
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef QUANTILES_H
+#define QUANTILES_H
+
+#include "engines.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Queries answered by a single task in the batch functions; smaller
+ * batches are answered in the calling thread
+ *
+ */
+const size_t QUANTILE_GRAIN = 1024;
+
+/**
+ * @brief Percentiles usually reported for a latency-like distribution
+ *
+ */
+const std::vector<double> COMMON_QUANTILES = {0.5, 0.9, 0.99, 0.999};
+
+/**
+ * @brief Index of the first element of a sorted array that is not less than
+ * x, as std::lower_bound, but without branches on the data: the loop always
+ * runs log2(n) times and the comparison becomes a conditional move, so it
+ * never mispredicts and consecutive queries overlap in the pipeline.
+ *
+ * @param sorted pointer to the sorted array (a cumulative histogram)
+ * @param n number of elements
+ * @param x value searched
+ * @return size_t with the index found, n if every element is less than x
+ */
+inline size_t branchless_lower_bound(const int64_t *sorted, size_t n, double x)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    const int64_t *base = sorted;
+    while (n > 1)
+    {
+        size_t half = n / 2;
+        base = base[half - 1] < x ? base + half : base;
+        n -= half;
+    }
+    return (base - sorted) + (*base < x);
+}
+
+/**
+ * @brief Lowest value covered by a bin, taking the bins as continuous: bin i
+ * spans [i x bin_span, (i + 1) x bin_span], so that the values of a bin can
+ * be interpolated linearly. The last bin is taken as bin_span wide too, even
+ * if it also holds every larger value.
+ *
+ * @param spec bins of the histogram
+ * @param bin index of the bin
+ * @return double with the lower edge of the bin
+ */
+inline double bin_lower_edge(const BinSpec &spec, size_t bin)
+{
+    return double(bin) * spec.bin_span;
+}
+
+/**
+ * @brief Inverse of the cumulative distribution: the value below which a
+ * fraction p of the values fall. The bin holding the p x total-th value is
+ * found in the cumulative histogram, and the value is interpolated linearly
+ * inside it, assuming its values are spread evenly.
+ *
+ * @param h histogram to be queried
+ * @param spec bins of the histogram
+ * @param p fraction of the values, between 0 and 1
+ * @return double with the value, 0 for an empty histogram
+ */
+inline double inverse_cdf(const Histogram &h, const BinSpec &spec, double p)
+{
+    const int64_t total = h.total();
+    if (total == 0)
+    {
+        return 0.0;
+    }
+    const double target = std::min(1.0, std::max(0.0, p)) * total;
+    size_t bin = std::min(branchless_lower_bound(h.cumulative.data(), h.cumulative.size(), target),
+                          h.cumulative.size() - 1);
+
+    // Empty bins have the same cumulative count as the previous one, so the
+    // search never stops at one unless p is 0
+    while (h.counts[bin] == 0 && bin + 1 < h.counts.size())
+    {
+        bin++;
+    }
+    const int64_t before = h.cumulative[bin] - h.counts[bin];
+    const double fraction = h.counts[bin] > 0 ? (target - before) / h.counts[bin] : 0.0;
+    return bin_lower_edge(spec, bin) + fraction * spec.bin_span;
+}
+
+/**
+ * @brief Estimated number of values not larger than a given one, counting
+ * every bin below it and the interpolated part of its own bin.
+ *
+ * @param h histogram to be queried
+ * @param spec bins of the histogram
+ * @param value value whose rank is wanted, any double
+ * @return double with the rank, between 0 and the total; 0 for values not
+ * above 0 and NaN
+ */
+inline double rank_of(const Histogram &h, const BinSpec &spec, double value)
+{
+    // NaN fails the comparison too; larger values are clamped to the last
+    // edge before they are converted to a bin
+    if (h.counts.empty() || !(value > 0))
+    {
+        return 0.0;
+    }
+    value = std::min(value, double(h.counts.size()) * spec.bin_span);
+    const size_t bin = std::min(size_t(value / spec.bin_span), h.counts.size() - 1);
+    const int64_t before = h.cumulative[bin] - h.counts[bin];
+    const double fraction = std::min(1.0, (value - bin_lower_edge(spec, bin)) / spec.bin_span);
+    return before + fraction * h.counts[bin];
+}
+
+/**
+ * @brief Answers a batch of inverse-CDF queries. Large batches are split into
+ * tasks of QUANTILE_GRAIN queries; the cumulative histogram is only read, so
+ * they need no synchronization.
+ *
+ * @param h histogram to be queried
+ * @param spec bins of the histogram
+ * @param ps fractions of the values, between 0 and 1
+ * @return std::vector<double> with a value per fraction, in the same order
+ */
+inline std::vector<double> quantiles(const Histogram &h, const BinSpec &spec, const std::vector<double> &ps)
+{
+    std::vector<double> values(ps.size());
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, ps.size(), QUANTILE_GRAIN),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                values[i] = inverse_cdf(h, spec, ps[i]);
+            }
+        },
+        oneapi::tbb::simple_partitioner());
+    return values;
+}
+
+/**
+ * @brief Answers a batch of rank queries, split into tasks as quantiles.
+ *
+ * @param h histogram to be queried
+ * @param spec bins of the histogram
+ * @param values values whose rank is wanted
+ * @return std::vector<double> with a rank per value, in the same order
+ */
+inline std::vector<double> ranks(const Histogram &h, const BinSpec &spec, const std::vector<double> &values)
+{
+    std::vector<double> result(values.size());
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, values.size(), QUANTILE_GRAIN),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                result[i] = rank_of(h, spec, values[i]);
+            }
+        },
+        oneapi::tbb::simple_partitioner());
+    return result;
+}
+
+#endif
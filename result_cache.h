@@ -0,0 +1,344 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "dataset.h"
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <climits>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Estimated bytes of bookkeeping per cached histogram, on top of its
+ * counters
+ *
+ */
+const size_t CACHE_ENTRY_OVERHEAD_BYTES = 160;
+
+/**
+ * @brief Range of values counted by a histogram, both ends included. Values
+ * outside it are left out. By default every value is counted.
+ *
+ */
+struct ValueFilter
+{
+    int low = INT_MIN;
+    int high = INT_MAX;
+
+    bool accepts(int value) const
+    {
+        return value >= low && value <= high;
+    }
+
+    bool all() const
+    {
+        return low == INT_MIN && high == INT_MAX;
+    }
+};
+
+/**
+ * @brief Histogram of the values that pass a filter, counted with private
+ * histograms like privatized_histogram.
+ *
+ * @param values pointer to the values to be classified
+ * @param n number of values
+ * @param spec bins of the histogram
+ * @param filter range of values counted
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram filtered_histogram(const int *values, size_t n, const BinSpec &spec, const ValueFilter &filter)
+{
+    if (filter.all())
+    {
+        return privatized_histogram(values, n, spec);
+    }
+    PROFILE_STAGE(count_timer, "filtered", "count");
+    Histogram h;
+    h.counts = oneapi::tbb::parallel_reduce(
+        oneapi::tbb::blocked_range<size_t>(0, n), std::vector<int64_t>(spec.num_bins),
+        [&](const oneapi::tbb::blocked_range<size_t> &r, std::vector<int64_t> counts)
+        {
+            TRACE_CHUNK("count", r);
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                if (filter.accepts(values[i]))
+                {
+                    counts[spec.bin_of(values[i])]++;
+                }
+            }
+            return counts;
+        },
+        [](std::vector<int64_t> a, const std::vector<int64_t> &b)
+        {
+            for (size_t j = 0; j < a.size(); j++)
+            {
+                a[j] += b[j];
+            }
+            return a;
+        });
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(scan_timer, "filtered", "scan");
+    h.cumulative = cumulative_sum(h.counts);
+    PROFILE_STOP(scan_timer);
+    return h;
+}
+
+/**
+ * @brief Whether a histogram with coarse bins can be derived by adding up
+ * the counters of one with fine bins. Every coarse bin must be a whole number
+ * of fine bins, and the last coarse bin, which takes any larger value, must
+ * start at or before the last fine bin.
+ *
+ * @param fine bins of the histogram available
+ * @param coarse bins of the histogram wanted
+ * @return true if the fine bins nest in the coarse ones
+ */
+inline bool bins_nest(const BinSpec &fine, const BinSpec &coarse)
+{
+    if (coarse.bin_span % fine.bin_span != 0)
+    {
+        return false;
+    }
+    const int64_t k = coarse.bin_span / fine.bin_span;
+    return int64_t(coarse.num_bins - 1) * k <= int64_t(fine.num_bins - 1);
+}
+
+/**
+ * @brief Coarse histogram from a fine one whose bins nest in it.
+ *
+ * @see bins_nest
+ * @param fine histogram with the fine bins
+ * @param fine_spec fine bins
+ * @param coarse_spec coarse bins
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram coarsen(const Histogram &fine, const BinSpec &fine_spec, const BinSpec &coarse_spec)
+{
+    const int k = coarse_spec.bin_span / fine_spec.bin_span;
+    Histogram h;
+    h.counts.assign(coarse_spec.num_bins, 0);
+    for (size_t j = 0; j < fine.counts.size(); j++)
+    {
+        h.counts[std::min(int(j) / k, coarse_spec.num_bins - 1)] += fine.counts[j];
+    }
+    h.cumulative = cumulative_sum(h.counts);
+    return h;
+}
+
+/**
+ * @brief Counters of the hits and misses of a HistogramCache.
+ *
+ */
+struct CacheStats
+{
+    int64_t hits = 0;      // Found as they were asked for
+    int64_t derived = 0;   // Added up from a cached histogram with finer bins
+    int64_t misses = 0;    // Computed from the values
+    int64_t evictions = 0; // Dropped to stay within the budget
+    size_t bytes = 0;
+    size_t entries = 0;
+};
+
+/**
+ * @brief Cache of histograms by dataset, version, bins and filter, so
+ * repeated requests are not counted again. Histograms are dropped least
+ * recently used first to keep their counters within a budget of bytes, and
+ * all those of a dataset are dropped when it changes. A histogram whose bins
+ * are not cached may still be derived from a cached one with finer bins that
+ * nest in them.
+ *
+ * Safe to use from several threads; histograms are computed outside the lock.
+ *
+ */
+class HistogramCache
+{
+public:
+    explicit HistogramCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    /**
+     * @brief Histogram of a dataset, from the cache if possible, otherwise
+     * computed and cached.
+     *
+     * @param dataset version of a dataset
+     * @param spec bins of the histogram
+     * @param filter range of values counted
+     * @return std::shared_ptr<const Histogram> with the histogram
+     */
+    std::shared_ptr<const Histogram> histogram(const Dataset &dataset, const BinSpec &spec,
+                                               const ValueFilter &filter = ValueFilter())
+    {
+        std::shared_ptr<const Histogram> cached = find(dataset.id, dataset.version, spec, filter);
+        if (cached)
+        {
+            return cached;
+        }
+        std::shared_ptr<const Histogram> h = std::make_shared<const Histogram>(
+            filtered_histogram(dataset.values.data(), dataset.values.size(), spec, filter));
+        insert(dataset.id, dataset.version, spec, filter, h);
+        return h;
+    }
+
+    /**
+     * @brief Looks a histogram up, deriving it from finer bins if needed.
+     * Counts the lookup as a hit, a derivation or a miss.
+     *
+     * @param dataset id of the dataset
+     * @param version version of the dataset
+     * @param spec bins of the histogram
+     * @param filter range of values counted
+     * @return std::shared_ptr<const Histogram> null if it is not cached
+     */
+    std::shared_ptr<const Histogram> find(uint64_t dataset, uint64_t version, const BinSpec &spec,
+                                          const ValueFilter &filter = ValueFilter())
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto found = entries.find(Key{dataset, version, filter.low, filter.high, spec.bin_span, spec.num_bins});
+        if (found != entries.end())
+        {
+            lru.splice(lru.begin(), lru, found->second);
+            counters.hits++;
+            return found->second->histogram;
+        }
+
+        // Cached histograms of the same dataset, version and filter are
+        // contiguous: take the one with the fewest bins that nest
+        const Key first{dataset, version, filter.low, filter.high, 0, 0};
+        std::shared_ptr<const Histogram> fine;
+        BinSpec fine_spec{1, 1};
+        for (auto it = entries.lower_bound(first); it != entries.end() && it->first.same_input(first); ++it)
+        {
+            const BinSpec candidate{it->first.bin_span, it->first.num_bins};
+            if (bins_nest(candidate, spec) && (!fine || candidate.num_bins < fine_spec.num_bins))
+            {
+                fine = it->second->histogram;
+                fine_spec = candidate;
+            }
+        }
+        if (!fine)
+        {
+            counters.misses++;
+            return nullptr;
+        }
+        counters.derived++;
+        lock.unlock();
+
+        std::shared_ptr<const Histogram> h = std::make_shared<const Histogram>(coarsen(*fine, fine_spec, spec));
+        insert(dataset, version, spec, filter, h);
+        return h;
+    }
+
+    /**
+     * @brief Caches a histogram, dropping the least recently used ones if it
+     * does not fit. Histograms larger than the whole budget are not cached.
+     *
+     * @param dataset id of the dataset
+     * @param version version of the dataset
+     * @param spec bins of the histogram
+     * @param filter range of values counted
+     * @param histogram histogram to be cached
+     */
+    void insert(uint64_t dataset, uint64_t version, const BinSpec &spec, const ValueFilter &filter,
+                std::shared_ptr<const Histogram> histogram)
+    {
+        const size_t size = bytes_of(*histogram);
+        if (size > budget)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        const Key key{dataset, version, filter.low, filter.high, spec.bin_span, spec.num_bins};
+        if (entries.count(key) > 0)
+        {
+            return;
+        }
+        while (counters.bytes + size > budget)
+        {
+            erase(std::prev(lru.end()));
+            counters.evictions++;
+        }
+        lru.push_front(Entry{key, std::move(histogram), size});
+        entries[key] = lru.begin();
+        counters.bytes += size;
+    }
+
+    /**
+     * @brief Drops every histogram of a dataset, to be called when it changes.
+     *
+     * @param dataset id of the dataset
+     */
+    void invalidate(uint64_t dataset)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.lower_bound(Key{dataset, 0, INT_MIN, INT_MIN, 0, 0});
+        while (it != entries.end() && it->first.dataset == dataset)
+        {
+            erase((it++)->second);
+        }
+    }
+
+    CacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        CacheStats stats = counters;
+        stats.entries = entries.size();
+        return stats;
+    }
+
+private:
+    struct Key
+    {
+        uint64_t dataset;
+        uint64_t version;
+        int low;
+        int high;
+        int bin_span;
+        int num_bins;
+
+        bool same_input(const Key &other) const
+        {
+            return dataset == other.dataset && version == other.version && low == other.low && high == other.high;
+        }
+
+        bool operator<(const Key &other) const
+        {
+            return std::tie(dataset, version, low, high, bin_span, num_bins) <
+                   std::tie(other.dataset, other.version, other.low, other.high, other.bin_span, other.num_bins);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        std::shared_ptr<const Histogram> histogram;
+        size_t bytes;
+    };
+
+    static size_t bytes_of(const Histogram &h)
+    {
+        return (h.counts.size() + h.cumulative.size()) * sizeof(int64_t) + CACHE_ENTRY_OVERHEAD_BYTES;
+    }
+
+    void erase(std::list<Entry>::iterator entry)
+    {
+        counters.bytes -= entry->bytes;
+        entries.erase(entry->key);
+        lru.erase(entry);
+    }
+
+    mutable std::mutex mutex;
+    size_t budget;
+    std::list<Entry> lru; // Most recently used first
+    std::map<Key, std::list<Entry>::iterator> entries;
+    CacheStats counters;
+};
+
+#endif
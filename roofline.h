@@ -0,0 +1,129 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <oneapi/tbb/task_arena.h>
+#include <oneapi/tbb/tick_count.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+/**
+ * @brief Streaming read bandwidth achieved with a given number of threads.
+ *
+ */
+struct RooflinePoint
+{
+    int threads;
+    double gb_per_second;
+};
+
+/**
+ * @brief Measures how fast a number of threads can stream through a buffer,
+ * reading every element once and summing them (the STREAM idea, read-only,
+ * which is the access pattern of a histogram). The best of several
+ * repetitions is kept, as it is the closest to what the machine can do.
+ *
+ * @param buffer data to be read, of the same size as the histogram input
+ * @param threads number of threads of the arena running the sum
+ * @param repetitions number of times the buffer is read
+ * @return double with the bandwidth in GB/s
+ */
+inline double measure_read_bandwidth(const std::vector<int> &buffer, int threads, int repetitions)
+{
+    oneapi::tbb::task_arena arena(threads);
+    const double bytes = double(buffer.size()) * sizeof(int);
+    double best = 0.0;
+
+    for (int rep = 0; rep < repetitions; rep++)
+    {
+        long long sum = 0;
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        arena.execute([&]
+                      { sum = oneapi::tbb::parallel_reduce(
+                            oneapi::tbb::blocked_range<size_t>(0, buffer.size()),
+                            0LL,
+                            [&](oneapi::tbb::blocked_range<size_t> r, long long total)
+                            {
+                                for (size_t i = r.begin(); i < r.end(); i++)
+                                {
+                                    total += buffer[i];
+                                }
+                                return total;
+                            },
+                            [](long long x, long long y)
+                            {
+                                return x + y;
+                            }); });
+        double seconds = (oneapi::tbb::tick_count::now() - t0).seconds();
+
+        // Keep the sum alive so the reads cannot be optimized away
+        volatile long long sink = sum;
+        (void)sink;
+
+        best = std::max(best, bytes / seconds / 1e9);
+    }
+    return best;
+}
+
+/**
+ * @brief Measures the read bandwidth for 1, 2, 4, ... threads up to the
+ * default concurrency of the machine, which is always included.
+ *
+ * @param buffer data to be read, of the same size as the histogram input
+ * @param repetitions number of times the buffer is read for each thread count
+ * @return std::vector<RooflinePoint> in increasing number of threads
+ */
+inline std::vector<RooflinePoint> measure_roofline(const std::vector<int> &buffer, int repetitions)
+{
+    const int max_threads = oneapi::tbb::info::default_concurrency();
+    std::vector<RooflinePoint> points;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        points.push_back(RooflinePoint{threads, measure_read_bandwidth(buffer, threads, repetitions)});
+    }
+    points.push_back(RooflinePoint{max_threads, measure_read_bandwidth(buffer, max_threads, repetitions)});
+    return points;
+}
+
+/**
+ * @brief Prints the roofline and, for every solution benchmarked, the rate at
+ * which it consumes its input as a percentage of the bandwidth available with
+ * all the threads. Solutions close to 100% are bound by memory and will not
+ * get faster by improving their kernels.
+ *
+ * @param points roofline measured with measure_roofline
+ * @param entries stage statistics, whose "total" stages are used
+ * @param input_bytes size of the input of each run
+ * @param os stream where the report is printed
+ */
+inline void print_roofline(const std::vector<RooflinePoint> &points, const std::vector<StageEntry> &entries,
+                           double input_bytes, std::ostream &os)
+{
+    os << std::left << std::setw(10) << "THREADS" << std::right << std::setw(14) << "READ (GB/s)" << std::endl;
+    for (const RooflinePoint &p : points)
+    {
+        os << std::left << std::setw(10) << p.threads << std::right << std::setw(14) << p.gb_per_second << std::endl;
+    }
+    os << std::endl;
+
+    const double roofline = points.empty() ? 0.0 : points.back().gb_per_second;
+    os << std::left << std::setw(14) << "SOLUTION" << std::right << std::setw(14) << "INPUT (GB/s)"
+       << std::setw(16) << "% OF ROOFLINE" << std::endl;
+    for (const StageEntry &e : entries)
+    {
+        if (e.stage != "total" || e.stats.mean() <= 0.0)
+        {
+            continue;
+        }
+        double throughput = input_bytes / e.stats.mean() / 1e9;
+        os << std::left << std::setw(14) << e.solution << std::right << std::setw(14) << throughput
+           << std::setw(15) << (roofline > 0.0 ? 100.0 * throughput / roofline : 0.0) << "%" << std::endl;
+    }
+}
+
+#endif
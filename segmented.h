@@ -0,0 +1,201 @@
+#ifndef SEGMENTED_H
+#define SEGMENTED_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Values counted by each task of the segmented engine, whatever the
+ * segments they belong to
+ *
+ */
+const size_t SEGMENTED_CHUNK_VALUES = 1 << 16;
+
+/**
+ * @brief Histograms of the segments of a buffer, as dense matrices with a
+ * row of num_bins counters per segment.
+ *
+ */
+struct SegmentedHistograms
+{
+    BinSpec spec{1, 1};
+    size_t segments = 0;
+    std::vector<int64_t> counts;
+    std::vector<int64_t> cumulative;
+
+    const int64_t *counts_of(size_t segment) const
+    {
+        return counts.data() + segment * spec.num_bins;
+    }
+
+    const int64_t *cumulative_of(size_t segment) const
+    {
+        return cumulative.data() + segment * spec.num_bins;
+    }
+};
+
+/**
+ * @brief Segmented engine: one histogram per segment of a buffer, where
+ * segment s holds the values from offsets[s] to offsets[s + 1]. Work is split
+ * by values, not by segments, so a few huge segments among many small ones
+ * do not leave one task counting alone: the buffer is cut into chunks of
+ * SEGMENTED_CHUNK_VALUES values, whatever the segments.
+ *
+ * Segments that lie within a chunk are counted straight into their rows,
+ * which no other task touches. Segments cut by the edges of a chunk are
+ * counted into carries, at most two per chunk, which are added to their rows
+ * once every chunk is done, in parallel over the segments. Finally the rows
+ * are scanned in parallel.
+ *
+ * Every carry is a whole row, so the carries can take up to
+ * 2 x chunks x num_bins counters on top of the result: with many bins, this
+ * engine suits buffers of at most a few hundred chunks.
+ *
+ * @param values pointer to the values to be classified
+ * @param offsets non-decreasing offsets of the segments, one more than the
+ * number of segments
+ * @param spec bins of every histogram
+ * @return SegmentedHistograms with the regular and cumulative histogram of
+ * every segment
+ */
+inline SegmentedHistograms segmented_histograms(const int *values, const std::vector<size_t> &offsets, const BinSpec &spec)
+{
+    SegmentedHistograms result;
+    result.spec = spec;
+    result.segments = offsets.empty() ? 0 : offsets.size() - 1;
+    result.counts.assign(result.segments * spec.num_bins, 0);
+    result.cumulative.assign(result.segments * spec.num_bins, 0);
+    if (result.segments == 0)
+    {
+        return result;
+    }
+
+    struct Carry
+    {
+        size_t segment;
+        std::vector<int64_t> counts;
+    };
+    const size_t first_value = offsets.front();
+    const size_t n = offsets.back() - first_value;
+    const size_t chunks = (n + SEGMENTED_CHUNK_VALUES - 1) / SEGMENTED_CHUNK_VALUES;
+    std::vector<std::vector<Carry>> carries(chunks);
+
+    PROFILE_STAGE(count_timer, "segmented", "count");
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, chunks, 1),
+        [&](const oneapi::tbb::blocked_range<size_t> &r)
+        {
+            TRACE_CHUNK("count", r);
+            for (size_t c = r.begin(); c < r.end(); c++)
+            {
+                const size_t begin = first_value + c * SEGMENTED_CHUNK_VALUES;
+                const size_t end = std::min(begin + SEGMENTED_CHUNK_VALUES, offsets.back());
+
+                // Last segment starting at or before the chunk; empty ones are skipped
+                size_t s = size_t(std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin()) - 1;
+                for (size_t i = begin; i < end; s++)
+                {
+                    const size_t segment_end = std::min(offsets[s + 1], end);
+                    if (segment_end <= i)
+                    {
+                        continue;
+                    }
+                    int64_t *row = result.counts.data() + s * spec.num_bins;
+                    const bool cut = offsets[s] < begin || offsets[s + 1] > end;
+                    if (cut)
+                    {
+                        carries[c].push_back(Carry{s, std::vector<int64_t>(spec.num_bins)});
+                        row = carries[c].back().counts.data();
+                    }
+                    for (; i < segment_end; i++)
+                    {
+                        row[spec.bin_of(values[i])]++;
+                    }
+                }
+            }
+        });
+    PROFILE_STOP(count_timer);
+
+    // Carries come out sorted by segment, since both chunks and the segments
+    // within a chunk are in order; each run of a segment is added by one task
+    PROFILE_STAGE(carry_timer, "segmented", "carry");
+    std::vector<const Carry *> cut;
+    for (const std::vector<Carry> &chunk : carries)
+    {
+        for (const Carry &carry : chunk)
+        {
+            cut.push_back(&carry);
+        }
+    }
+    std::vector<size_t> runs;
+    for (size_t k = 0; k < cut.size(); k++)
+    {
+        if (k == 0 || cut[k]->segment != cut[k - 1]->segment)
+        {
+            runs.push_back(k);
+        }
+    }
+    runs.push_back(cut.size());
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, runs.size() - 1),
+        [&](const oneapi::tbb::blocked_range<size_t> &r)
+        {
+            TRACE_CHUNK("carry", r);
+            for (size_t run = r.begin(); run < r.end(); run++)
+            {
+                int64_t *row = result.counts.data() + cut[runs[run]]->segment * spec.num_bins;
+                for (size_t k = runs[run]; k < runs[run + 1]; k++)
+                {
+                    for (int j = 0; j < spec.num_bins; j++)
+                    {
+                        row[j] += cut[k]->counts[j];
+                    }
+                }
+            }
+        });
+    PROFILE_STOP(carry_timer);
+
+    PROFILE_STAGE(scan_timer, "segmented", "scan");
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, result.segments),
+        [&](const oneapi::tbb::blocked_range<size_t> &r)
+        {
+            TRACE_CHUNK("scan", r);
+            for (size_t s = r.begin(); s < r.end(); s++)
+            {
+                const int64_t *counts = result.counts.data() + s * spec.num_bins;
+                int64_t *cumulative = result.cumulative.data() + s * spec.num_bins;
+                int64_t total = 0;
+                for (int j = 0; j < spec.num_bins; j++)
+                {
+                    total += counts[j];
+                    cumulative[j] = total;
+                }
+            }
+        });
+    PROFILE_STOP(scan_timer);
+    return result;
+}
+
+/**
+ * @brief Segmented engine over a whole vector.
+ *
+ * @see segmented_histograms(const int *, const std::vector<size_t> &, const BinSpec &)
+ * @param values values to be classified
+ * @param offsets non-decreasing offsets of the segments into values
+ * @param spec bins of every histogram
+ * @return SegmentedHistograms with the regular and cumulative histogram of
+ * every segment
+ */
+inline SegmentedHistograms segmented_histograms(const std::vector<int> &values, const std::vector<size_t> &offsets,
+                                                const BinSpec &spec)
+{
+    return segmented_histograms(values.data(), offsets, spec);
+}
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef SERIALIZATION_H
+#define SERIALIZATION_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_reduce.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief First bytes of every serialized histogram, and version of the format
+ *
+ */
+const uint8_t SERIALIZED_MAGIC[4] = {'H', 'I', 'S', 'T'};
+const uint8_t SERIALIZED_VERSION = 1;
+
+/**
+ * @brief Flags of the serialized format
+ *
+ */
+const uint8_t SERIALIZED_HAS_AGGREGATES = 1;
+
+/**
+ * @brief Histogram of one shard of a dataset, to be combined with the ones of
+ * the other shards. It keeps the regular counts only, as the cumulative ones
+ * can only be computed once all the shards are merged, and optionally the
+ * smallest, largest and sum of the values.
+ *
+ */
+struct PartialHistogram
+{
+    BinSpec spec{1, 1};
+    std::vector<int64_t> counts;
+    bool has_aggregates = false;
+    int64_t min = 0;
+    int64_t max = 0;
+    int64_t sum = 0;
+
+    /**
+     * @brief Number of values of the shard.
+     *
+     * @return int64_t with the sum of the counts
+     */
+    int64_t total() const
+    {
+        int64_t total = 0;
+        for (int64_t count : counts)
+        {
+            total += count;
+        }
+        return total;
+    }
+};
+
+/**
+ * @brief Computes the partial histogram of a shard with the privatized
+ * engine, and its aggregates with a parallel_reduce if asked for.
+ *
+ * @param values pointer to the values of the shard
+ * @param n number of values
+ * @param spec bins of the histogram, the same for every shard
+ * @param with_aggregates whether to compute the min, max and sum
+ * @return PartialHistogram of the shard
+ */
+inline PartialHistogram partial_histogram(const int *values, size_t n, const BinSpec &spec, bool with_aggregates = true)
+{
+    PartialHistogram partial;
+    partial.spec = spec;
+    partial.counts = privatized_histogram(values, n, spec).counts;
+    if (with_aggregates && n > 0)
+    {
+        struct Aggregates
+        {
+            int64_t min, max, sum;
+        };
+        Aggregates aggregates = oneapi::tbb::parallel_reduce(
+            oneapi::tbb::blocked_range<size_t>(0, n),
+            Aggregates{INT64_MAX, INT64_MIN, 0},
+            [&](oneapi::tbb::blocked_range<size_t> r, Aggregates total)
+            {
+                for (size_t i = r.begin(); i < r.end(); i++)
+                {
+                    total.min = std::min<int64_t>(total.min, values[i]);
+                    total.max = std::max<int64_t>(total.max, values[i]);
+                    total.sum += values[i];
+                }
+                return total;
+            },
+            [](Aggregates left, const Aggregates &right)
+            {
+                return Aggregates{std::min(left.min, right.min), std::max(left.max, right.max), left.sum + right.sum};
+            });
+        partial.has_aggregates = true;
+        partial.min = aggregates.min;
+        partial.max = aggregates.max;
+        partial.sum = aggregates.sum;
+    }
+    return partial;
+}
+
+/**
+ * @brief Maps signed integers to unsigned ones so that small magnitudes of
+ * either sign become small numbers: 0, -1, 1, -2... to 0, 1, 2, 3...
+ *
+ */
+inline uint64_t zigzag_encode(int64_t value)
+{
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value)
+{
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+/**
+ * @brief Appends an unsigned integer as a varint: 7 bits per byte, lowest
+ * first, with the high bit set on every byte but the last.
+ *
+ * @param out buffer where the bytes are appended
+ * @param value integer to be written
+ */
+inline void put_varint(std::vector<uint8_t> &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(uint8_t(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+/**
+ * @brief Reads a varint written by put_varint.
+ *
+ * @param data cursor into the buffer, advanced past the varint
+ * @param end end of the buffer
+ * @param value integer read
+ * @return true if a whole varint was read, false if the buffer is truncated
+ * or the varint is longer than 64 bits
+ */
+inline bool get_varint(const uint8_t *&data, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7)
+    {
+        const uint8_t byte = *data++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Serializes a partial histogram into a compact binary buffer:
+ *
+ *  - The magic bytes "HIST", the version and the flags.
+ *  - The bin span and number of bins, as varints.
+ *  - Every count as the zigzag varint of its difference with the previous
+ *    one. Neighbouring bins tend to have similar counts, so most counts take
+ *    one or two bytes instead of eight.
+ *  - With SERIALIZED_HAS_AGGREGATES, the min, max and sum as zigzag varints.
+ *
+ * @param partial histogram to be serialized
+ * @return std::vector<uint8_t> with the bytes
+ */
+inline std::vector<uint8_t> serialize_histogram(const PartialHistogram &partial)
+{
+    std::vector<uint8_t> out(SERIALIZED_MAGIC, SERIALIZED_MAGIC + sizeof(SERIALIZED_MAGIC));
+    out.push_back(SERIALIZED_VERSION);
+    out.push_back(partial.has_aggregates ? SERIALIZED_HAS_AGGREGATES : 0);
+    put_varint(out, uint64_t(partial.spec.bin_span));
+    put_varint(out, partial.counts.size());
+    int64_t previous = 0;
+    for (int64_t count : partial.counts)
+    {
+        put_varint(out, zigzag_encode(count - previous));
+        previous = count;
+    }
+    if (partial.has_aggregates)
+    {
+        put_varint(out, zigzag_encode(partial.min));
+        put_varint(out, zigzag_encode(partial.max));
+        put_varint(out, zigzag_encode(partial.sum));
+    }
+    return out;
+}
+
+/**
+ * @brief Reads a partial histogram written by serialize_histogram.
+ *
+ * @param data pointer to the bytes
+ * @param size number of bytes
+ * @param partial histogram read
+ * @return true if the buffer held a whole histogram of a known version, with
+ * no negative count
+ */
+inline bool deserialize_histogram(const uint8_t *data, size_t size, PartialHistogram &partial)
+{
+    const uint8_t *end = data + size;
+    if (size < sizeof(SERIALIZED_MAGIC) + 2 || std::memcmp(data, SERIALIZED_MAGIC, sizeof(SERIALIZED_MAGIC)) != 0 ||
+        data[sizeof(SERIALIZED_MAGIC)] != SERIALIZED_VERSION)
+    {
+        return false;
+    }
+    const uint8_t flags = data[sizeof(SERIALIZED_MAGIC) + 1];
+    data += sizeof(SERIALIZED_MAGIC) + 2;
+
+    uint64_t bin_span, num_bins;
+    if (!get_varint(data, end, bin_span) || !get_varint(data, end, num_bins) || bin_span == 0 ||
+        bin_span > uint64_t(INT32_MAX) || num_bins == 0 || num_bins > uint64_t(end - data))
+    {
+        return false;
+    }
+    partial.spec = BinSpec{int(bin_span), int(num_bins)};
+    partial.counts.resize(num_bins);
+    int64_t previous = 0;
+    for (int64_t &count : partial.counts)
+    {
+        uint64_t encoded;
+        if (!get_varint(data, end, encoded))
+        {
+            return false;
+        }
+        // previous is never negative, so only a positive delta can overflow
+        const int64_t delta = zigzag_decode(encoded);
+        if (delta > INT64_MAX - previous || previous + delta < 0)
+        {
+            return false;
+        }
+        count = previous + delta;
+        previous = count;
+    }
+
+    partial.has_aggregates = flags & SERIALIZED_HAS_AGGREGATES;
+    if (partial.has_aggregates)
+    {
+        uint64_t min, max, sum;
+        if (!get_varint(data, end, min) || !get_varint(data, end, max) || !get_varint(data, end, sum))
+        {
+            return false;
+        }
+        partial.min = zigzag_decode(min);
+        partial.max = zigzag_decode(max);
+        partial.sum = zigzag_decode(sum);
+    }
+    return data == end;
+}
+
+/**
+ * @brief Merges the partial histograms of N shards. The bins are split
+ * between tasks, and each task sums its bins over all the shards, so every
+ * bin of the result is written once and no task waits for another. The
+ * aggregates are only kept if every shard has them.
+ *
+ * @param partials histograms of the shards
+ * @param merged histogram of the whole dataset
+ * @return true if all the shards use the same bins and no count nor the sum
+ * overflows
+ */
+inline bool merge_partials(const std::vector<PartialHistogram> &partials, PartialHistogram &merged)
+{
+    if (partials.empty())
+    {
+        return false;
+    }
+    for (const PartialHistogram &partial : partials)
+    {
+        if (!(partial.spec == partials[0].spec) || partial.counts.size() != partials[0].counts.size())
+        {
+            return false;
+        }
+    }
+
+    PROFILE_STAGE(merge_timer, "serialized", "merge");
+    merged = PartialHistogram();
+    merged.spec = partials[0].spec;
+    merged.counts.assign(partials[0].counts.size(), 0);
+    std::atomic<bool> overflow{false};
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, merged.counts.size()),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("merge", r);
+            for (const PartialHistogram &partial : partials)
+            {
+                for (size_t j = r.begin(); j < r.end(); j++)
+                {
+                    if (__builtin_add_overflow(merged.counts[j], partial.counts[j], &merged.counts[j]))
+                    {
+                        overflow.store(true, std::memory_order_relaxed);
+                    }
+                }
+            }
+        });
+    if (overflow)
+    {
+        return false;
+    }
+
+    merged.has_aggregates = true;
+    merged.min = INT64_MAX;
+    merged.max = INT64_MIN;
+    for (const PartialHistogram &partial : partials)
+    {
+        // Empty shards have no aggregates to contribute
+        if (partial.has_aggregates)
+        {
+            merged.min = std::min(merged.min, partial.min);
+            merged.max = std::max(merged.max, partial.max);
+            if (__builtin_add_overflow(merged.sum, partial.sum, &merged.sum))
+            {
+                return false;
+            }
+        }
+        else if (std::any_of(partial.counts.begin(), partial.counts.end(), [](int64_t count)
+                             { return count != 0; }))
+        {
+            merged.has_aggregates = false;
+        }
+    }
+    if (!merged.has_aggregates || merged.min > merged.max)
+    {
+        merged.has_aggregates = false;
+        merged.min = merged.max = merged.sum = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief Deserializes the buffers of N shards in parallel and merges them.
+ *
+ * @param buffers serialized histograms of the shards
+ * @param merged histogram of the whole dataset
+ * @return true if every buffer is valid and all of them use the same bins
+ */
+inline bool merge_serialized(const std::vector<std::vector<uint8_t>> &buffers, PartialHistogram &merged)
+{
+    PROFILE_STAGE(decode_timer, "serialized", "decode");
+    std::vector<PartialHistogram> partials(buffers.size());
+    std::vector<char> valid(buffers.size());
+    oneapi::tbb::parallel_for(size_t(0), buffers.size(), [&](size_t i)
+                              { valid[i] = deserialize_histogram(buffers[i].data(), buffers[i].size(), partials[i]); });
+    PROFILE_STOP(decode_timer);
+    if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+    {
+        return false;
+    }
+    return merge_partials(partials, merged);
+}
+
+/**
+ * @brief Cumulative histogram of a merged partial histogram.
+ *
+ * @param partial histogram whose counts are final
+ * @return Histogram with the regular and cumulative histograms
+ */
+inline Histogram to_histogram(const PartialHistogram &partial)
+{
+    Histogram h;
+    h.counts = partial.counts;
+    h.cumulative = cumulative_sum(h.counts);
+    return h;
+}
+
+#endif
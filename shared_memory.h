@@ -0,0 +1,311 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include "engines.h"
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/tick_count.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SHARED_MEMORY_SUPPORTED 1
+#else
+#define SHARED_MEMORY_SUPPORTED 0
+#endif
+
+/**
+ * @brief Identifies a segment created by SharedHistogram
+ *
+ */
+const uint64_t SHARED_HISTOGRAM_MAGIC = 0x5341435f48495354ULL; // "SAC_HIST"
+
+/**
+ * @brief Regions are padded to whole pages, so no two processes ever write
+ * to the same page: there is no false sharing, and each process first
+ * touches its own pages, which places them on its NUMA node
+ *
+ */
+const size_t SHARED_PAGE_BYTES = 4096;
+
+/**
+ * @brief Histogram shared between processes on the same host through a POSIX
+ * shared memory segment. The coordinator creates the segment with one region
+ * per process; every process opens it, counts its shard into its own
+ * region and flags it as ready; the coordinator waits for all the regions
+ * and merges and scans them. No values or counts are ever serialized or
+ * copied through a socket.
+ *
+ * Layout of the segment: a header page, then one region per process, each
+ * with its ready flag and number of values on the first cache line and its
+ * counters after it.
+ *
+ */
+class SharedHistogram
+{
+public:
+    SharedHistogram() = default;
+    SharedHistogram(const SharedHistogram &) = delete;
+    SharedHistogram &operator=(const SharedHistogram &) = delete;
+
+    ~SharedHistogram()
+    {
+        close();
+    }
+
+    /**
+     * @brief Creates the segment, as the coordinator. It is removed when this
+     * object is destroyed.
+     *
+     * @param name name of the segment, starting with '/'
+     * @param spec bins of the histogram
+     * @param processes number of regions, one per process
+     * @return true if the segment was created and mapped
+     */
+    bool create(const std::string &name, const BinSpec &spec, int processes)
+    {
+#if SHARED_MEMORY_SUPPORTED
+        const size_t region = region_bytes(spec.num_bins);
+        const size_t bytes = SHARED_PAGE_BYTES + size_t(processes) * region;
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        this->name = name;
+        owner = true;
+        if (ftruncate(fd, off_t(bytes)) != 0 || !map(fd, bytes))
+        {
+            ::close(fd);
+            close();
+            return false;
+        }
+        ::close(fd);
+
+        Header *header = this->header();
+        header->bin_span = spec.bin_span;
+        header->num_bins = spec.num_bins;
+        header->processes = processes;
+        header->region_bytes = region;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHARED_HISTOGRAM_MAGIC;
+        return true;
+#else
+        (void)name, (void)spec, (void)processes;
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Opens a segment created by the coordinator, as a worker.
+     *
+     * @param name name of the segment, starting with '/'
+     * @return true if the segment exists and holds a shared histogram
+     */
+    bool open(const std::string &name)
+    {
+#if SHARED_MEMORY_SUPPORTED
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        const bool mapped = fstat(fd, &info) == 0 && size_t(info.st_size) >= SHARED_PAGE_BYTES &&
+                            map(fd, size_t(info.st_size));
+        ::close(fd);
+        if (!mapped || header()->magic != SHARED_HISTOGRAM_MAGIC ||
+            SHARED_PAGE_BYTES + size_t(header()->processes) * header()->region_bytes > bytes)
+        {
+            close();
+            return false;
+        }
+        return true;
+#else
+        (void)name;
+        return false;
+#endif
+    }
+
+    BinSpec spec() const
+    {
+        return BinSpec{header()->bin_span, header()->num_bins};
+    }
+
+    int processes() const
+    {
+        return header()->processes;
+    }
+
+    /**
+     * @brief Counts a shard into the region of a process and flags it as
+     * ready. The shard is counted with private histograms per thread, which
+     * are then added to the region, so the threads of the process do not
+     * contend on it either.
+     *
+     * @param process index of the region
+     * @param values pointer to the values of the shard
+     * @param n number of values
+     * @return true if the segment has a region with that index
+     */
+    bool accumulate(int process, const int *values, size_t n)
+    {
+        if (process < 0 || process >= processes())
+        {
+            return false;
+        }
+        PROFILE_STAGE(count_timer, "shared_memory", "count");
+        const std::vector<int64_t> counts = privatized_histogram(values, n, spec()).counts;
+        Region *region = this->region(process);
+        std::copy(counts.begin(), counts.end(), counts_of(process));
+        region->values = int64_t(n);
+        region->ready.store(1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Waits until every process has flagged its region as ready.
+     *
+     * @param timeout_seconds seconds after which it gives up
+     * @return true if all the regions are ready
+     */
+    bool wait(double timeout_seconds) const
+    {
+        oneapi::tbb::tick_count t0 = oneapi::tbb::tick_count::now();
+        for (int p = 0; p < processes(); p++)
+        {
+            while (region(p)->ready.load(std::memory_order_acquire) == 0)
+            {
+                if ((oneapi::tbb::tick_count::now() - t0).seconds() > timeout_seconds)
+                {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Merges the regions of all the processes and scans the result.
+     * Each task sums a range of bins over all the regions.
+     *
+     * @return Histogram with the regular and cumulative histograms
+     */
+    Histogram merge() const
+    {
+        PROFILE_STAGE(merge_timer, "shared_memory", "merge");
+        Histogram h;
+        h.counts.assign(header()->num_bins, 0);
+        oneapi::tbb::parallel_for(
+            oneapi::tbb::blocked_range<size_t>(0, h.counts.size()),
+            [&](oneapi::tbb::blocked_range<size_t> r)
+            {
+                TRACE_CHUNK("merge", r);
+                for (int p = 0; p < processes(); p++)
+                {
+                    const int64_t *counts = counts_of(p);
+                    for (size_t j = r.begin(); j < r.end(); j++)
+                    {
+                        h.counts[j] += counts[j];
+                    }
+                }
+            });
+        PROFILE_STOP(merge_timer);
+
+        PROFILE_STAGE(scan_timer, "shared_memory", "scan");
+        h.cumulative = cumulative_sum(h.counts);
+        PROFILE_STOP(scan_timer);
+        return h;
+    }
+
+private:
+    struct Header
+    {
+        uint64_t magic;
+        int32_t bin_span;
+        int32_t num_bins;
+        int32_t processes;
+        uint64_t region_bytes;
+    };
+
+    // The counters follow the region header, on the next cache line
+    struct alignas(64) Region
+    {
+        std::atomic<uint32_t> ready;
+        int64_t values;
+    };
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "flags must work across processes");
+
+    static size_t region_bytes(int num_bins)
+    {
+        const size_t bytes = sizeof(Region) + size_t(num_bins) * sizeof(int64_t);
+        return (bytes + SHARED_PAGE_BYTES - 1) / SHARED_PAGE_BYTES * SHARED_PAGE_BYTES;
+    }
+
+    Header *header() const
+    {
+        return static_cast<Header *>(base);
+    }
+
+    Region *region(int process) const
+    {
+        return reinterpret_cast<Region *>(static_cast<char *>(base) + SHARED_PAGE_BYTES +
+                                          size_t(process) * header()->region_bytes);
+    }
+
+    int64_t *counts_of(int process) const
+    {
+        return reinterpret_cast<int64_t *>(region(process) + 1);
+    }
+
+    bool map(int fd, size_t bytes)
+    {
+#if SHARED_MEMORY_SUPPORTED
+        void *address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            return false;
+        }
+        base = address;
+        this->bytes = bytes;
+        return true;
+#else
+        (void)fd, (void)bytes;
+        return false;
+#endif
+    }
+
+    void close()
+    {
+#if SHARED_MEMORY_SUPPORTED
+        if (base != nullptr)
+        {
+            munmap(base, bytes);
+            base = nullptr;
+        }
+        if (owner)
+        {
+            shm_unlink(name.c_str());
+            owner = false;
+        }
+#endif
+    }
+
+    void *base = nullptr;
+    size_t bytes = 0;
+    std::string name;
+    bool owner = false;
+};
+
+#endif
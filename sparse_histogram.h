@@ -0,0 +1,379 @@
+#ifndef SPARSE_HISTOGRAM_H
+#define SPARSE_HISTOGRAM_H
+
+#include "instrumentation.h"
+#include <oneapi/tbb/blocked_range.h>
+#include <oneapi/tbb/concurrent_hash_map.h>
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/parallel_for.h>
+#include <oneapi/tbb/parallel_scan.h>
+#include <oneapi/tbb/parallel_sort.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief One bin of a sparse histogram: a key that appears in the input, how
+ * many times it does, and how many values have a key up to it.
+ *
+ */
+struct SparseBin
+{
+    uint64_t key;
+    int64_t count;
+    int64_t cumulative;
+};
+
+/**
+ * @brief Keys below this limit are counted in a plain array inlined in every
+ * table, as small keys (ids, codes) tend to be the most frequent ones
+ *
+ */
+const uint64_t SPARSE_SMALL_KEYS = 256;
+
+/**
+ * @brief The tables of every thread are split by the high bits of the hash
+ * into 2^SPARSE_PARTITION_BITS partitions, which are merged in parallel
+ *
+ */
+const int SPARSE_PARTITION_BITS = 6;
+
+/**
+ * @brief Mixes the bits of a key (splitmix64 finalizer), so that both the
+ * partition (high bits) and the slot (low bits) are well spread.
+ *
+ * @param key key to be hashed
+ * @return uint64_t with the hash
+ */
+inline uint64_t hash_key(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+/**
+ * @brief Open-addressing hash table with linear probing that counts keys. A
+ * slot is free while its count is 0, so any key can be stored. It doubles
+ * its capacity before getting half full.
+ *
+ */
+class CountTable
+{
+public:
+    /**
+     * @brief Adds occurrences of a key.
+     *
+     * @param key key to be counted
+     * @param hash hash_key(key)
+     * @param count occurrences to be added
+     */
+    void add(uint64_t key, uint64_t hash, int64_t count)
+    {
+        if (2 * (used + 1) > counts.size())
+        {
+            grow();
+        }
+        const size_t mask = counts.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+        {
+            if (counts[slot] == 0)
+            {
+                keys[slot] = key;
+                counts[slot] = count;
+                used++;
+                return;
+            }
+            if (keys[slot] == key)
+            {
+                counts[slot] += count;
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Adds all the keys of another table.
+     *
+     * @param other table to be merged into this one
+     */
+    void merge(const CountTable &other)
+    {
+        for (size_t slot = 0; slot < other.counts.size(); slot++)
+        {
+            if (other.counts[slot] > 0)
+            {
+                add(other.keys[slot], hash_key(other.keys[slot]), other.counts[slot]);
+            }
+        }
+    }
+
+    /**
+     * @brief Appends every key with its count to a list of bins.
+     *
+     * @param bins list where the keys are appended, with no cumulative count
+     */
+    void extract(std::vector<SparseBin> &bins) const
+    {
+        for (size_t slot = 0; slot < counts.size(); slot++)
+        {
+            if (counts[slot] > 0)
+            {
+                bins.push_back(SparseBin{keys[slot], counts[slot], 0});
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return used;
+    }
+
+private:
+    void grow()
+    {
+        std::vector<uint64_t> old_keys;
+        std::vector<int64_t> old_counts;
+        old_keys.swap(keys);
+        old_counts.swap(counts);
+        keys.assign(std::max<size_t>(16, 2 * old_counts.size()), 0);
+        counts.assign(keys.size(), 0);
+        used = 0;
+        for (size_t slot = 0; slot < old_counts.size(); slot++)
+        {
+            if (old_counts[slot] > 0)
+            {
+                add(old_keys[slot], hash_key(old_keys[slot]), old_counts[slot]);
+            }
+        }
+    }
+
+    std::vector<uint64_t> keys;
+    std::vector<int64_t> counts;
+    size_t used = 0;
+};
+
+/**
+ * @brief Private counts of one thread: small keys in an inlined array, the
+ * rest in one hash table per partition.
+ *
+ */
+struct SparseCounts
+{
+    std::array<int64_t, SPARSE_SMALL_KEYS> small{};
+    std::array<CountTable, size_t(1) << SPARSE_PARTITION_BITS> partitions;
+
+    void add(uint64_t key)
+    {
+        if (key < SPARSE_SMALL_KEYS)
+        {
+            small[key]++;
+            return;
+        }
+        uint64_t hash = hash_key(key);
+        partitions[hash >> (64 - SPARSE_PARTITION_BITS)].add(key, hash, 1);
+    }
+};
+
+/**
+ * @brief Sorts the bins by key and fills their cumulative counts with a
+ * parallel_scan.
+ *
+ * @param bins bins to be completed
+ */
+inline void sort_and_accumulate(std::vector<SparseBin> &bins)
+{
+    oneapi::tbb::parallel_sort(bins.begin(), bins.end(), [](const SparseBin &a, const SparseBin &b)
+                               { return a.key < b.key; });
+    oneapi::tbb::parallel_scan(
+        oneapi::tbb::blocked_range<size_t>(0, bins.size()),
+        int64_t(0),
+        [&](oneapi::tbb::blocked_range<size_t> r, int64_t total, bool is_final_scan)
+        {
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                total += bins[i].count;
+                if (is_final_scan)
+                {
+                    bins[i].cumulative = total;
+                }
+            }
+            return total;
+        },
+        [](int64_t x, int64_t y)
+        {
+            return x + y;
+        });
+}
+
+/**
+ * @brief Histogram of 64-bit keys over a huge or unknown key space, where a
+ * dense array of bins is impossible: there is one bin per distinct key.
+ *
+ *  1. Count: every thread counts its chunks into its own SparseCounts, with
+ *     no synchronization at all.
+ *  2. Merge: partitions are merged in parallel, each one gathering the same
+ *     partition of every thread; keys of different partitions never meet.
+ *  3. Sort and scan: the bins are sorted by key and accumulated.
+ *
+ * @param keys pointer to the keys to be counted
+ * @param n number of keys
+ * @return std::vector<SparseBin> sorted by key
+ */
+inline std::vector<SparseBin> sparse_histogram(const uint64_t *keys, size_t n)
+{
+    PROFILE_STAGE(count_timer, "sparse", "count");
+    oneapi::tbb::enumerable_thread_specific<SparseCounts> locals;
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("count", r);
+            SparseCounts &local = locals.local();
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                local.add(keys[i]);
+            }
+        });
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(merge_timer, "sparse", "merge");
+    const size_t partitions = size_t(1) << SPARSE_PARTITION_BITS;
+    std::vector<SparseCounts *> threads;
+    for (SparseCounts &local : locals)
+    {
+        threads.push_back(&local);
+    }
+
+    // Partition p of every thread goes to merged[p]; the small keys come last
+    std::vector<std::vector<SparseBin>> merged(partitions + 1);
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, partitions + 1, 1),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            for (size_t p = r.begin(); p < r.end(); p++)
+            {
+                if (p == partitions)
+                {
+                    for (uint64_t key = 0; key < SPARSE_SMALL_KEYS; key++)
+                    {
+                        int64_t count = 0;
+                        for (SparseCounts *t : threads)
+                        {
+                            count += t->small[key];
+                        }
+                        if (count > 0)
+                        {
+                            merged[p].push_back(SparseBin{key, count, 0});
+                        }
+                    }
+                    continue;
+                }
+
+                CountTable table;
+                for (SparseCounts *t : threads)
+                {
+                    table.merge(t->partitions[p]);
+                }
+                merged[p].reserve(table.size());
+                table.extract(merged[p]);
+            }
+        });
+
+    std::vector<size_t> offsets(merged.size() + 1);
+    for (size_t p = 0; p < merged.size(); p++)
+    {
+        offsets[p + 1] = offsets[p] + merged[p].size();
+    }
+    std::vector<SparseBin> bins(offsets.back());
+    oneapi::tbb::parallel_for(size_t(0), merged.size(), [&](size_t p)
+                              { std::copy(merged[p].begin(), merged[p].end(), bins.begin() + offsets[p]); });
+    PROFILE_STOP(merge_timer);
+
+    PROFILE_STAGE(sort_timer, "sparse", "sort");
+    sort_and_accumulate(bins);
+    PROFILE_STOP(sort_timer);
+    return bins;
+}
+
+/**
+ * @brief Same histogram as sparse_histogram, but counting into a single
+ * tbb::concurrent_hash_map shared by all the threads, for comparison.
+ *
+ * @param keys pointer to the keys to be counted
+ * @param n number of keys
+ * @return std::vector<SparseBin> sorted by key
+ */
+inline std::vector<SparseBin> sparse_histogram_concurrent_map(const uint64_t *keys, size_t n)
+{
+    using Map = oneapi::tbb::concurrent_hash_map<uint64_t, int64_t>;
+
+    PROFILE_STAGE(count_timer, "hash_map", "count");
+    Map map;
+    oneapi::tbb::parallel_for(
+        oneapi::tbb::blocked_range<size_t>(0, n),
+        [&](oneapi::tbb::blocked_range<size_t> r)
+        {
+            TRACE_CHUNK("count", r);
+            for (size_t i = r.begin(); i < r.end(); i++)
+            {
+                Map::accessor a;
+                map.insert(a, keys[i]);
+                a->second++;
+            }
+        });
+    PROFILE_STOP(count_timer);
+
+    PROFILE_STAGE(merge_timer, "hash_map", "merge");
+    std::vector<SparseBin> bins;
+    bins.reserve(map.size());
+    for (const Map::value_type &entry : map)
+    {
+        bins.push_back(SparseBin{entry.first, entry.second, 0});
+    }
+    PROFILE_STOP(merge_timer);
+
+    PROFILE_STAGE(sort_timer, "hash_map", "sort");
+    sort_and_accumulate(bins);
+    PROFILE_STOP(sort_timer);
+    return bins;
+}
+
+/**
+ * @brief Same histogram as sparse_histogram, but sorting a copy of the keys
+ * and counting the runs of equal keys, for comparison.
+ *
+ * @param keys pointer to the keys to be counted
+ * @param n number of keys
+ * @return std::vector<SparseBin> sorted by key
+ */
+inline std::vector<SparseBin> sparse_histogram_sort(const uint64_t *keys, size_t n)
+{
+    PROFILE_STAGE(sort_timer, "sort_rle", "sort");
+    std::vector<uint64_t> sorted(keys, keys + n);
+    oneapi::tbb::parallel_sort(sorted.begin(), sorted.end());
+    PROFILE_STOP(sort_timer);
+
+    PROFILE_STAGE(rle_timer, "sort_rle", "run_length");
+    std::vector<SparseBin> bins;
+    int64_t total = 0;
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i + 1;
+        while (j < n && sorted[j] == sorted[i])
+        {
+            j++;
+        }
+        total += int64_t(j - i);
+        bins.push_back(SparseBin{sorted[i], int64_t(j - i), total});
+        i = j;
+    }
+    PROFILE_STOP(rle_timer);
+    return bins;
+}
+
+#endif
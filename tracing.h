@@ -0,0 +1,248 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#ifndef TRACE
+#define TRACE 0 // Set to 1 to record every chunk executed by TBB and export a Chrome trace; 0 to deactivate
+#endif
+
+#include "utilization.h"
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A span of time spent by one thread on one piece of work: a chunk of
+ * a parallel loop, or a whole stage when it comes from a stage timer.
+ *
+ */
+struct TraceEvent
+{
+    const char *solution; // Only set for whole stages
+    const char *name;
+    int64_t begin_ns;
+    int64_t end_ns;
+    long range_begin;
+    long range_end;
+    bool is_chunk;
+};
+
+/**
+ * @brief Events of a single thread. Only the owner thread appends to it, so
+ * recording needs no locks; the buffer is read once the parallel algorithms
+ * have finished.
+ *
+ */
+struct ThreadTraceBuffer
+{
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+/**
+ * @brief Collects the events of every thread and writes them in the Chrome
+ * trace event format, which can be opened with Perfetto (ui.perfetto.dev) or
+ * chrome://tracing to see how the chunks were spread across the threads.
+ *
+ */
+class Tracer
+{
+public:
+    /**
+     * @brief Returns the global tracer.
+     *
+     * @return Tracer& shared by all the threads
+     */
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    /**
+     * @brief Nanoseconds elapsed since the tracer was created.
+     *
+     * @return int64_t with the current timestamp
+     */
+    int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    /**
+     * @brief Returns the buffer of the calling thread, registering it the first
+     * time the thread records something.
+     *
+     * @return ThreadTraceBuffer& owned by the calling thread
+     */
+    ThreadTraceBuffer &local_buffer()
+    {
+        thread_local ThreadTraceBuffer *buffer = nullptr;
+        if (buffer == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.emplace_back(new ThreadTraceBuffer{int(buffers.size()), {}});
+            buffers.back()->events.reserve(4096);
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    /**
+     * @brief Records an event on the calling thread.
+     *
+     * @param event span to be recorded
+     */
+    void record(const TraceEvent &event)
+    {
+        local_buffer().events.push_back(event);
+    }
+
+    /**
+     * @brief Discards the events recorded so far. It must not be called while
+     * a parallel algorithm is running.
+     *
+     */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::unique_ptr<ThreadTraceBuffer> &b : buffers)
+        {
+            b->events.clear();
+        }
+    }
+
+    /**
+     * @brief Writes all the events as Chrome trace JSON. Timestamps are in
+     * microseconds and every chunk carries the range it processed. It must not
+     * be called while a parallel algorithm is running.
+     *
+     * @param path file where the trace is written
+     * @return true if the file could be written, false otherwise
+     */
+    bool write_chrome_json(const std::string &path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        file << std::fixed << std::setprecision(3);
+        file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (const std::unique_ptr<ThreadTraceBuffer> &b : buffers)
+        {
+            file << (first ? "" : ",") << std::endl
+                 << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << b->tid
+                 << ",\"args\":{\"name\":\"thread " << b->tid << "\"}}";
+            first = false;
+
+            for (const TraceEvent &e : b->events)
+            {
+                file << "," << std::endl
+                     << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid << ",\"name\":\"";
+                if (e.is_chunk)
+                {
+                    file << e.name << " chunk\",\"cat\":\"chunk\"";
+                }
+                else
+                {
+                    file << e.solution << " " << e.name << "\",\"cat\":\"stage\"";
+                }
+                file << ",\"ts\":" << e.begin_ns / 1000.0 << ",\"dur\":" << (e.end_ns - e.begin_ns) / 1000.0;
+                if (e.is_chunk)
+                {
+                    file << ",\"args\":{\"begin\":" << e.range_begin << ",\"end\":" << e.range_end
+                         << ",\"size\":" << e.range_end - e.range_begin << "}";
+                }
+                file << "}";
+            }
+        }
+        file << std::endl
+             << "]}" << std::endl;
+        return bool(file);
+    }
+
+private:
+    Tracer() : epoch(std::chrono::steady_clock::now()) {}
+
+    std::chrono::steady_clock::time_point epoch;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadTraceBuffer>> buffers;
+};
+
+// Chunks only feed the utilization monitor when the benchmark is profiled
+#if defined(PROFILE) && PROFILE && UTILIZATION
+#define CHUNK_UTILIZATION 1
+#else
+#define CHUNK_UTILIZATION 0
+#endif
+
+/**
+ * @brief RAII recorder of one chunk of a parallel loop, placed at the top of
+ * the body that receives the range. The chunk goes to the trace in TRACE mode
+ * and, in PROFILE and UTILIZATION mode, to the utilization monitor while it
+ * monitors a run. Otherwise the clock is not even read.
+ *
+ */
+class ChunkTrace
+{
+public:
+    ChunkTrace(const char *stage, long range_begin, long range_end)
+        : stage(stage), range_begin(range_begin), range_end(range_end), recording(enabled()),
+          begin_ns(recording ? Tracer::instance().now() : 0)
+    {
+    }
+
+    ChunkTrace(const ChunkTrace &) = delete;
+    ChunkTrace &operator=(const ChunkTrace &) = delete;
+
+    ~ChunkTrace()
+    {
+#if TRACE || CHUNK_UTILIZATION
+        if (!recording)
+        {
+            return;
+        }
+        int64_t end_ns = Tracer::instance().now();
+#if TRACE
+        Tracer::instance().record(TraceEvent{nullptr, stage, begin_ns, end_ns, range_begin, range_end, true});
+#endif
+#if CHUNK_UTILIZATION
+        UtilizationMonitor::instance().record_chunk(end_ns - begin_ns, range_end - range_begin);
+#endif
+#endif
+    }
+
+private:
+    static bool enabled()
+    {
+#if TRACE
+        return true;
+#elif CHUNK_UTILIZATION
+        return UtilizationMonitor::instance().monitoring_run();
+#else
+        return false;
+#endif
+    }
+
+    const char *stage;
+    long range_begin;
+    long range_end;
+    bool recording;
+    int64_t begin_ns;
+};
+
+#if TRACE || CHUNK_UTILIZATION
+#define TRACE_CHUNK(stage, range) ChunkTrace chunk_trace(stage, long((range).begin()), long((range).end()))
+#else
+#define TRACE_CHUNK(stage, range) ((void)0)
+#endif
+
+#endif
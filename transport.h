@@ -0,0 +1,389 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define SOCKETS_SUPPORTED 1
+#else
+#define SOCKETS_SUPPORTED 0
+#endif
+
+/**
+ * @brief Largest message accepted, so a corrupt length cannot make a peer
+ * allocate without bound
+ *
+ */
+const uint32_t MAX_MESSAGE_BYTES = 1u << 30;
+
+/**
+ * @brief Connection between two processes that exchanges whole messages.
+ *
+ */
+class Connection
+{
+public:
+    virtual ~Connection() = default;
+
+    /**
+     * @brief Sends a message.
+     *
+     * @param message bytes of the message
+     * @return true if the whole message was sent
+     */
+    virtual bool send(const std::vector<uint8_t> &message) = 0;
+
+    /**
+     * @brief Waits for the next message.
+     *
+     * @param message bytes of the message received
+     * @return true if a whole message was received, false once the peer has
+     * closed the connection
+     */
+    virtual bool receive(std::vector<uint8_t> &message) = 0;
+
+    /**
+     * @brief Closes the connection for both peers, making any receive in
+     * progress on it return false.
+     *
+     */
+    virtual void shutdown() {}
+};
+
+/**
+ * @brief Endpoint waiting for connections.
+ *
+ */
+class Listener
+{
+public:
+    virtual ~Listener() = default;
+
+    /**
+     * @brief Waits for the next connection.
+     *
+     * @return std::unique_ptr<Connection> accepted, null on error
+     */
+    virtual std::unique_ptr<Connection> accept() = 0;
+
+    /**
+     * @brief Waits until a connection can be accepted without blocking. By
+     * default it does not wait, and accept blocks instead.
+     *
+     * @param timeout_ms milliseconds after which it gives up
+     * @return true if a connection is waiting
+     */
+    virtual bool wait_for_connection(int timeout_ms)
+    {
+        (void)timeout_ms;
+        return true;
+    }
+
+    /**
+     * @brief Address peers connect to, with any port chosen by the system.
+     *
+     * @return std::string with the address
+     */
+    virtual std::string address() const = 0;
+};
+
+/**
+ * @brief Way of connecting processes, so the coordinator does not depend on
+ * sockets: anything that can listen on an address and connect to one can
+ * carry the shards and partial histograms.
+ *
+ */
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+    virtual std::unique_ptr<Listener> listen(const std::string &address) = 0;
+    virtual std::unique_ptr<Connection> connect(const std::string &address) = 0;
+};
+
+#if SOCKETS_SUPPORTED
+/**
+ * @brief Connection over a stream socket. Every message is preceded by its
+ * length as 4 bytes in network order.
+ *
+ */
+class SocketConnection : public Connection
+{
+public:
+    explicit SocketConnection(int fd) : fd(fd) {}
+
+    ~SocketConnection() override
+    {
+        ::close(fd);
+    }
+
+    bool send(const std::vector<uint8_t> &message) override
+    {
+        const uint32_t length = htonl(uint32_t(message.size()));
+        return write_all(&length, sizeof(length)) && write_all(message.data(), message.size());
+    }
+
+    bool receive(std::vector<uint8_t> &message) override
+    {
+        uint32_t length;
+        if (!read_all(&length, sizeof(length)) || ntohl(length) > MAX_MESSAGE_BYTES)
+        {
+            return false;
+        }
+        message.resize(ntohl(length));
+        return read_all(message.data(), message.size());
+    }
+
+    void shutdown() override
+    {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+private:
+    bool write_all(const void *data, size_t size)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            // MSG_NOSIGNAL: a closed peer is an error to report, not a SIGPIPE
+            ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            bytes += written;
+            size -= size_t(written);
+        }
+        return true;
+    }
+
+    bool read_all(void *data, size_t size)
+    {
+        char *bytes = static_cast<char *>(data);
+        while (size > 0)
+        {
+            ssize_t got = ::recv(fd, bytes, size, 0);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                return false;
+            }
+            bytes += got;
+            size -= size_t(got);
+        }
+        return true;
+    }
+
+    int fd;
+};
+
+/**
+ * @brief Listening stream socket. A Unix socket file is removed when the
+ * listener is destroyed.
+ *
+ */
+class SocketListener : public Listener
+{
+public:
+    SocketListener(int fd, std::string address, std::string path)
+        : fd(fd), bound_address(std::move(address)), path(std::move(path)) {}
+
+    ~SocketListener() override
+    {
+        ::close(fd);
+        if (!path.empty())
+        {
+            unlink(path.c_str());
+        }
+    }
+
+    std::unique_ptr<Connection> accept() override
+    {
+        int client;
+        do
+        {
+            client = ::accept(fd, nullptr, nullptr);
+        } while (client < 0 && errno == EINTR);
+        if (client < 0)
+        {
+            return nullptr;
+        }
+        const int yes = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // Fails harmlessly on Unix sockets
+        return std::unique_ptr<Connection>(new SocketConnection(client));
+    }
+
+    bool wait_for_connection(int timeout_ms) override
+    {
+        pollfd waiting{fd, POLLIN, 0};
+        int ready;
+        do
+        {
+            ready = ::poll(&waiting, 1, timeout_ms);
+        } while (ready < 0 && errno == EINTR);
+        return ready > 0;
+    }
+
+    std::string address() const override
+    {
+        return bound_address;
+    }
+
+private:
+    int fd;
+    std::string bound_address;
+    std::string path;
+};
+#endif
+
+/**
+ * @brief Transport over stream sockets, for processes on the same host or on
+ * different ones. Addresses are "unix:<path>" for a Unix domain socket, or
+ * "tcp:<IPv4 address>:<port>" for TCP, where port 0 lets the system choose.
+ *
+ */
+class SocketTransport : public Transport
+{
+public:
+    std::unique_ptr<Listener> listen(const std::string &address) override
+    {
+#if SOCKETS_SUPPORTED
+        sockaddr_storage storage;
+        socklen_t length;
+        std::string path;
+        if (!resolve(address, storage, length, path))
+        {
+            return nullptr;
+        }
+        int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        const int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (!path.empty())
+        {
+            unlink(path.c_str());
+        }
+        if (bind(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0 || ::listen(fd, SOMAXCONN) != 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+
+        // Report the port the system chose, if it was asked to
+        std::string bound = address;
+        if (storage.ss_family == AF_INET)
+        {
+            sockaddr_in bound_address;
+            socklen_t bound_length = sizeof(bound_address);
+            getsockname(fd, reinterpret_cast<sockaddr *>(&bound_address), &bound_length);
+            char host[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &bound_address.sin_addr, host, sizeof(host));
+            bound = "tcp:" + std::string(host) + ":" + std::to_string(ntohs(bound_address.sin_port));
+        }
+        return std::unique_ptr<Listener>(new SocketListener(fd, bound, path));
+#else
+        (void)address;
+        return nullptr;
+#endif
+    }
+
+    std::unique_ptr<Connection> connect(const std::string &address) override
+    {
+#if SOCKETS_SUPPORTED
+        sockaddr_storage storage;
+        socklen_t length;
+        std::string path;
+        if (!resolve(address, storage, length, path))
+        {
+            return nullptr;
+        }
+        int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        if (storage.ss_family == AF_INET)
+        {
+            // Messages are small and answered at once: do not wait to fill packets
+            const int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        return std::unique_ptr<Connection>(new SocketConnection(fd));
+#else
+        (void)address;
+        return nullptr;
+#endif
+    }
+
+private:
+#if SOCKETS_SUPPORTED
+    static bool resolve(const std::string &address, sockaddr_storage &storage, socklen_t &length, std::string &path)
+    {
+        std::memset(&storage, 0, sizeof(storage));
+        if (address.compare(0, 5, "unix:") == 0)
+        {
+            sockaddr_un *un = reinterpret_cast<sockaddr_un *>(&storage);
+            path = address.substr(5);
+            if (path.empty() || path.size() >= sizeof(un->sun_path))
+            {
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+            length = sizeof(sockaddr_un);
+            return true;
+        }
+        if (address.compare(0, 4, "tcp:") == 0)
+        {
+            const size_t colon = address.rfind(':');
+            sockaddr_in *in = reinterpret_cast<sockaddr_in *>(&storage);
+            in->sin_family = AF_INET;
+            if (colon <= 4 || inet_pton(AF_INET, address.substr(4, colon - 4).c_str(), &in->sin_addr) != 1)
+            {
+                return false;
+            }
+            char *end;
+            const long port = std::strtol(address.c_str() + colon + 1, &end, 10);
+            if (*end != '\0' || end == address.c_str() + colon + 1 || port < 0 || port > 65535)
+            {
+                return false;
+            }
+            in->sin_port = htons(uint16_t(port));
+            length = sizeof(sockaddr_in);
+            return true;
+        }
+        return false;
+    }
+#endif
+};
+
+#endif
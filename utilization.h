@@ -0,0 +1,362 @@
+#ifndef UTILIZATION_H
+#define UTILIZATION_H
+
+#ifndef UTILIZATION
+#define UTILIZATION 0 // Set to 1 to monitor how the threads are used during a parallel run; 0 to deactivate
+#endif
+
+#include <oneapi/tbb/enumerable_thread_specific.h>
+#include <oneapi/tbb/info.h>
+#include <oneapi/tbb/task_arena.h>
+#include <oneapi/tbb/task_scheduler_observer.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Nanoseconds of a monotonic clock shared by all the monitors.
+ *
+ * @return int64_t with the current timestamp
+ */
+inline int64_t utilization_clock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Time a thread has spent inside one arena during the monitored run.
+ * The fields are written by the owner thread from the observer callbacks and
+ * read by the thread that ends the run, hence the atomics.
+ *
+ */
+struct ArenaThreadStats
+{
+    std::thread::id thread = std::this_thread::get_id();
+    std::atomic<bool> is_worker{false};
+    std::atomic<bool> inside{false};
+    std::atomic<int64_t> entered_ns{0};
+    std::atomic<int64_t> joined_ns{0};
+    std::atomic<int> joins{0};
+};
+
+/**
+ * @brief Work done by a thread during the monitored run: the chunks of the
+ * parallel loops it executed and how long it spent on them.
+ *
+ */
+struct ChunkStats
+{
+    std::thread::id thread = std::this_thread::get_id();
+    std::atomic<int64_t> busy_ns{0};
+    std::atomic<long> chunks{0};
+    std::atomic<long> elements{0};
+};
+
+/**
+ * @brief Observer of a single arena that accounts for the time every thread
+ * spends inside it between entering and leaving.
+ *
+ */
+class ArenaObserver : public oneapi::tbb::task_scheduler_observer
+{
+public:
+    /**
+     * @brief Observes the arena of the calling thread (the implicit one if it
+     * has not joined any other).
+     *
+     * @param name label of the arena in the reports
+     */
+    explicit ArenaObserver(const std::string &name) : name(name) {}
+
+    /**
+     * @brief Observes an explicit arena.
+     *
+     * @param arena arena to be observed
+     * @param name label of the arena in the reports
+     */
+    ArenaObserver(oneapi::tbb::task_arena &arena, const std::string &name)
+        : oneapi::tbb::task_scheduler_observer(arena), name(name) {}
+
+    ~ArenaObserver()
+    {
+        observe(false);
+    }
+
+    void on_scheduler_entry(bool is_worker) override
+    {
+        ArenaThreadStats &s = stats.local();
+        s.is_worker = is_worker;
+        s.entered_ns = utilization_clock();
+        s.inside = true;
+        s.joins++;
+    }
+
+    void on_scheduler_exit(bool) override
+    {
+        ArenaThreadStats &s = stats.local();
+        int64_t from = std::max(s.entered_ns.load(), run_start_ns.load());
+        s.joined_ns += std::max<int64_t>(0, utilization_clock() - from);
+        s.inside = false;
+    }
+
+    /**
+     * @brief Forgets the time accounted so far, starting a new run.
+     *
+     * @param now timestamp of the beginning of the run
+     */
+    void reset(int64_t now)
+    {
+        run_start_ns = now;
+        for (ArenaThreadStats &s : stats)
+        {
+            s.joined_ns = 0;
+            s.joins = s.inside ? 1 : 0;
+        }
+    }
+
+    /**
+     * @brief Time each thread spent inside the arena up to a given moment,
+     * including the threads that are still inside.
+     *
+     * @param now timestamp of the end of the run
+     * @param thread thread whose time is requested
+     * @return int64_t with the nanoseconds spent inside the arena
+     */
+    int64_t joined_until(int64_t now, std::thread::id thread) const
+    {
+        for (const ArenaThreadStats &s : stats)
+        {
+            if (s.thread == thread)
+            {
+                int64_t open = s.inside ? std::max<int64_t>(0, now - std::max(s.entered_ns.load(), run_start_ns.load())) : 0;
+                return s.joined_ns + open;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Number of worker threads that joined the arena during the run.
+     *
+     * @return int with the number of workers
+     */
+    int workers_joined() const
+    {
+        int workers = 0;
+        for (const ArenaThreadStats &s : stats)
+        {
+            workers += s.is_worker && s.joins > 0 ? 1 : 0;
+        }
+        return workers;
+    }
+
+    const std::string name;
+
+private:
+    mutable oneapi::tbb::enumerable_thread_specific<ArenaThreadStats> stats;
+    std::atomic<int64_t> run_start_ns{0};
+};
+
+/**
+ * @brief Monitors how a parallel run uses the threads: how many workers join
+ * each observed arena, how long every thread stays inside, how much of that
+ * time it is busy on chunks and how many chunks it executes.
+ *
+ * TBB does not expose its steals, so chunks executed by a thread other than
+ * the one that started the run are reported as stolen, which is the only way
+ * a worker can get them.
+ *
+ */
+class UtilizationMonitor
+{
+public:
+    /**
+     * @brief Returns the global monitor.
+     *
+     * @return UtilizationMonitor& shared by all the threads
+     */
+    static UtilizationMonitor &instance()
+    {
+        static UtilizationMonitor monitor;
+        return monitor;
+    }
+
+    /**
+     * @brief Starts observing the arena of the calling thread.
+     *
+     */
+    void start()
+    {
+        arenas.emplace_back(new ArenaObserver("default"));
+        arenas.back()->observe(true);
+    }
+
+    /**
+     * @brief Starts observing an explicit arena as well.
+     *
+     * @param arena arena to be observed
+     * @param name label of the arena in the reports
+     */
+    void watch(oneapi::tbb::task_arena &arena, const std::string &name)
+    {
+        arenas.emplace_back(new ArenaObserver(arena, name));
+        arenas.back()->observe(true);
+    }
+
+    /**
+     * @brief Begins a monitored run on the calling thread, forgetting the
+     * statistics of previous runs.
+     *
+     */
+    void begin_run()
+    {
+        monitoring.store(true, std::memory_order_relaxed);
+        caller = std::this_thread::get_id();
+        run_start_ns = utilization_clock();
+        run_end_ns = 0;
+        for (std::unique_ptr<ArenaObserver> &a : arenas)
+        {
+            a->reset(run_start_ns);
+        }
+        for (ChunkStats &c : chunks)
+        {
+            c.busy_ns = 0;
+            c.chunks = 0;
+            c.elements = 0;
+        }
+    }
+
+    /**
+     * @brief Ends the monitored run.
+     *
+     */
+    void end_run()
+    {
+        run_end_ns = utilization_clock();
+        monitoring.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Whether a run is being monitored, so chunks outside runs are not
+     * timed at all.
+     *
+     * @return true between begin_run and end_run
+     */
+    bool monitoring_run() const
+    {
+        return monitoring.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Accounts for a chunk executed by the calling thread.
+     *
+     * @param duration_ns time spent on the chunk
+     * @param elements size of the range of the chunk
+     */
+    void record_chunk(int64_t duration_ns, long elements)
+    {
+        ChunkStats &c = chunks.local();
+        c.busy_ns += duration_ns;
+        c.chunks++;
+        c.elements += elements;
+    }
+
+    /**
+     * @brief Prints the utilization summary of the last run: workers per
+     * arena, and joined, busy and idle time plus chunks for every thread.
+     *
+     * @param os stream where the summary is printed
+     */
+    void print(std::ostream &os) const
+    {
+        const double wall_ms = (run_end_ns - run_start_ns) / 1e6;
+        os << "Run time: " << wall_ms << " ms" << std::endl;
+        for (const std::unique_ptr<ArenaObserver> &a : arenas)
+        {
+            os << "Arena '" << a->name << "': " << a->workers_joined() << " workers joined" << std::endl;
+        }
+        os << std::endl;
+
+        os << std::left << std::setw(8) << "THREAD" << std::setw(8) << "ROLE" << std::right
+           << std::setw(12) << "JOINED (ms)" << std::setw(12) << "BUSY (ms)" << std::setw(12) << "IDLE (ms)"
+           << std::setw(8) << "UTIL" << std::setw(10) << "CHUNKS" << std::setw(12) << "ELEMENTS" << std::endl;
+
+        int threads = 0;
+        long total_chunks = 0;
+        long stolen_chunks = 0;
+        double total_busy_ms = 0.0;
+        for (const ChunkStats &c : chunks)
+        {
+            if (c.chunks == 0)
+            {
+                continue;
+            }
+
+            // The caller runs the whole time; workers only while inside an arena
+            bool is_caller = c.thread == caller;
+            double joined_ms = wall_ms;
+            if (!is_caller)
+            {
+                int64_t joined_ns = 0;
+                for (const std::unique_ptr<ArenaObserver> &a : arenas)
+                {
+                    joined_ns += a->joined_until(run_end_ns, c.thread);
+                }
+                joined_ms = std::min(wall_ms, joined_ns / 1e6);
+            }
+            double busy_ms = std::min(joined_ms, c.busy_ns / 1e6);
+
+            os << std::left << std::setw(8) << threads << std::setw(8) << (is_caller ? "caller" : "worker") << std::right
+               << std::fixed << std::setprecision(3)
+               << std::setw(12) << joined_ms << std::setw(12) << busy_ms << std::setw(12) << joined_ms - busy_ms
+               << std::setprecision(1) << std::setw(7) << (wall_ms > 0 ? 100.0 * busy_ms / wall_ms : 0.0) << "%"
+               << std::setw(10) << c.chunks << std::setw(12) << c.elements << std::endl;
+            os.unsetf(std::ios::floatfield);
+            os << std::setprecision(6);
+
+            threads++;
+            total_chunks += c.chunks;
+            stolen_chunks += is_caller ? 0 : c.chunks.load();
+            total_busy_ms += busy_ms;
+        }
+
+        const double utilization = threads > 0 && wall_ms > 0 ? total_busy_ms / (threads * wall_ms) : 0.0;
+        os << std::endl
+           << "Threads with work: " << threads << " of " << oneapi::tbb::info::default_concurrency() << std::endl
+           << "Chunks: " << total_chunks << " (" << stolen_chunks << " stolen from the caller)" << std::endl
+           << "Utilization: " << std::setprecision(3) << 100.0 * utilization << "%" << std::setprecision(6) << std::endl;
+
+        // Rough hints on what limits the scaling
+        if (total_chunks < 4L * oneapi::tbb::info::default_concurrency())
+        {
+            os << "Hint: few chunks per thread, the work cannot be balanced (use a smaller grain size)" << std::endl;
+        }
+        else if (utilization < 0.7)
+        {
+            os << "Hint: threads are often idle, scaling is limited by scheduling or serial stages" << std::endl;
+        }
+        else
+        {
+            os << "Hint: threads are kept busy, check the memory bandwidth if speedup is still low" << std::endl;
+        }
+    }
+
+private:
+    UtilizationMonitor() = default;
+
+    std::vector<std::unique_ptr<ArenaObserver>> arenas;
+    oneapi::tbb::enumerable_thread_specific<ChunkStats> chunks;
+    std::thread::id caller;
+    int64_t run_start_ns = 0;
+    int64_t run_end_ns = 0;
+    std::atomic<bool> monitoring{false};
+};
+
+#endif